@@ -0,0 +1,105 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <atomic>
+#include <cstdint>
+#ifdef ARDUINO
+#include "Arduino.h"
+#include <esp_timer.h>
+#else
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#endif
+
+// Microbenchmarks. Results are printed one per line in a stable format so two
+// runs can be diffed:
+//   [bench] <name> <ops> ops <ns/op> ns/op <allocs/op> allocs/op
+//
+// The pure parts of the command path run on the host (pio test -e native -f
+// test_bench -v); the radio- and NVS-bound ones on the device, in the "bench"
+// PlatformIO environment (pio run -e bench -t upload -t monitor).
+//
+// On the device the bench environment links with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+// so every heap allocation (including operator new and std::string) goes
+// through the counters below; on the host operator new is counted.
+// Only include this header from one translation unit.
+
+std::atomic<uint32_t> benchAllocations{0};
+
+#ifdef ARDUINO
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    benchAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    benchAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    benchAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+}
+
+inline int64_t benchClockUs() { return esp_timer_get_time(); }
+#define BENCH_PRINTF Serial.printf
+#else
+void* operator new(size_t size) {
+    benchAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+inline int64_t benchClockUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#define BENCH_PRINTF printf
+#endif
+
+/**
+ * @brief Cost of one benchmark operation.
+ */
+struct BenchResult {
+    float nsPerOp;
+    float allocsPerOp;
+};
+
+/**
+ * @brief Time a benchmark body and print its cost and heap allocations per operation.
+ *
+ * @param name Name printed in front of the result.
+ * @param iterations Number of times to run the body.
+ * @param body Called with the iteration index; one call is one operation.
+ * @return Nanoseconds and heap allocations per operation.
+ */
+template <typename Body>
+BenchResult runBenchmark(const char* name, uint32_t iterations, Body body) {
+    body(0);  // Warm up caches and lazily initialised statics
+    const uint32_t allocationsBefore = benchAllocations.load(std::memory_order_relaxed);
+    const int64_t start = benchClockUs();
+    for (uint32_t i = 0; i < iterations; ++i) body(i);
+    const int64_t elapsedUs = benchClockUs() - start;
+    const uint32_t allocations = benchAllocations.load(std::memory_order_relaxed) - allocationsBefore;
+    BenchResult result;
+    result.nsPerOp = iterations ? (float)elapsedUs * 1000.0f / (float)iterations : 0.0f;
+    result.allocsPerOp = iterations ? (float)allocations / (float)iterations : 0.0f;
+    BENCH_PRINTF("[bench] %-36s %8lu ops %10.1f ns/op %8.2f allocs/op\n", name, (unsigned long)iterations, result.nsPerOp,
+                 result.allocsPerOp);
+    return result;
+}
+
+#endif // BENCH_H
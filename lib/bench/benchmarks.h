@@ -0,0 +1,68 @@
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+#include "bench.h"
+#include "websocket_server.h"
+#include "state_store.h"
+#include <nvs_flash.h>
+
+// The cases that need the radio, NVS or the device's memory; the pure parts of
+// the command path are benchmarked on the host (test/test_bench).
+
+/**
+ * @brief loadState against the real NVS.
+ *
+ * NVS writes are not benchmarked: thousands of writes would only wear the flash.
+ */
+void benchPersistence() {
+    saveState("bench_key", "status_damper2:on");
+    runBenchmark("loadState (nvs)", 2000, [](uint32_t) {
+        char value[48];
+        loadState("bench_key", value, sizeof(value));
+    });
+}
+
+/**
+ * @brief The BLE task's notification handling, up to the event for the network task.
+ */
+void benchNotifications() {
+    runBenchmark("notification to event", 20000, [](uint32_t i) {
+        VoltageNotification notification;
+        notification.index = (int8_t)(i % MAX_CLIENTS);
+        notification.format = VOLTAGE_BINARY;
+        notification.flags = 0;
+        notification.millivolts = (uint16_t)(12000 + i % 500);
+        bleClient.notifications.push(notification);
+        ble_notified();
+        GatewayEvent event;
+        while (eventQueue->pop(event)) {}
+    });
+}
+
+/**
+ * @brief Publishing the state document (link states, PSRAM slot) and taking a reference per request.
+ */
+void benchStateDocument() {
+    runBenchmark("state document to json (publish)", 10000, [](uint32_t) {
+        publishStateDocument();
+    });
+    runBenchmark("state document read (per request)", 50000, [](uint32_t) {
+        currentStateDocument();
+    });
+}
+
+/**
+ * @brief Runs every benchmark and prints the results to the serial console.
+ */
+void runBenchmarks() {
+    Serial.printf("[bench] start, cpu %lu MHz\n", (unsigned long)getCpuFrequencyMhz());
+    allocateBuffers();
+    if (nvs_flash_init() != ESP_OK) Serial.println("[bench] NVS init failed");
+    attachCommandPath();
+    benchPersistence();
+    benchNotifications();
+    benchStateDocument();
+    Serial.println("[bench] done");
+}
+
+#endif // BENCHMARKS_H
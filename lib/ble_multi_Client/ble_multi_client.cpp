@@ -1,22 +1,60 @@
 #include "ble_multi_client.h"
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#if defined(CONFIG_NIMBLE_CPP_IDF)
+#include "host/ble_gatt.h"
+#else
+#include "nimble/nimble/host/include/host/ble_gatt.h"
+#endif
 
+// The read in flight (BLE task only; ATT allows one request per link anyway). A
+// completion that arrives after its read timed out carries an older generation
+// and is dropped, so it never writes into a buffer the caller has given up.
+static portMUX_TYPE readLock = portMUX_INITIALIZER_UNLOCKED;
+static StaticSemaphore_t readDoneBuffer;
+static SemaphoreHandle_t readDone = nullptr;
+static uint32_t readGeneration = 0;
+static char* readBuffer = nullptr;
+static size_t readBufferSize = 0;
+static int readStatus = 0;
+
+// Runs on the NimBLE host task
+static int onReadComplete(uint16_t connHandle, const struct ble_gatt_error* error, struct ble_gatt_attr* attr, void* arg) {
+    bool current;
+    portENTER_CRITICAL(&readLock);
+    current = (uint32_t)(uintptr_t)arg == readGeneration;
+    if (current) {
+        readStatus = error->status;
+        if (readStatus == 0) {
+            const uint16_t length = attr ? OS_MBUF_PKTLEN(attr->om) : 0;
+            if (attr && length < readBufferSize && os_mbuf_copydata(attr->om, 0, length, readBuffer) == 0)
+                readBuffer[length] = '\0';
+            else
+                readStatus = BLE_HS_EMSGSIZE;
+        }
+    }
+    portEXIT_CRITICAL(&readLock);
+    if (current) xSemaphoreGive(readDone);
+    return 0;
+}
 
-// Define static members
-bool BLEClientMulti::notified = false;
-int BLEClientMulti::notifty_index = -1;
-std::string BLEClientMulti::per_voltage;
 
 class ScanCallbacks : public NimBLEScanCallbacks {
 public:
     explicit ScanCallbacks(BLEClientMulti* parent) : _parent(parent) {}
 
+    // Both callbacks run on the NimBLE host task: they only hand over to the BLE task
     void onResult(const NimBLEAdvertisedDevice* advertisedDevice) override {
-        _parent->doConnect = true;
-        _parent->MyAdvertisedDevice = const_cast<NimBLEAdvertisedDevice*>(advertisedDevice);
+        NimBLEAdvertisedDevice* device = const_cast<NimBLEAdvertisedDevice*>(advertisedDevice);
+        if (!_parent->isTargetDevice(device)) return;
+        ScanResult result;
+        result.address = device->getAddress();
+        result.rssi = (int8_t)device->getRSSI();
+        _parent->scanResults.push(result);  // Dropped if full: the device advertises again
     }
     void onScanEnd(const NimBLEScanResults& results, int reason) override {  // Matching signature
         Serial.printf("Scan ended (Reason: %d), restarting...\n", reason);
-        _parent->startScanning();  // Restart scan indefinitely
+        _parent->scanEnded.store(true, std::memory_order_release);  // Restarted by the BLE task
     }
 
 private:
@@ -26,12 +64,27 @@ private:
 class ClientCallbacks : public NimBLEClientCallbacks {
 public:
     explicit ClientCallbacks(BLEClientMulti* parent) : _parent(parent){}
-    // void onConnect(NimBLEClient* pClient) override {
-    //     Serial.println("Connected to the server.");
-    // }
+    // The callbacks run on the NimBLE host task: hand over to the BLE task which owns `clients`
+    void onConnect(NimBLEClient* pClient) override {
+        ConnectResult result;
+        result.client = pClient;
+        result.connected = true;
+        result.linkUpUs = esp_timer_get_time();
+        if (!_parent->connectResults.push(result))
+            Serial.println("Connect queue full!");
+    }
+    void onConnectFail(NimBLEClient* pClient, int reason) override {
+        ConnectResult result;
+        result.client = pClient;
+        result.connected = false;
+        result.linkUpUs = 0;
+        if (!_parent->connectResults.push(result))
+            Serial.println("Connect queue full!");
+    }
     void onDisconnect(NimBLEClient* pClient, int reason) override {
         // Serial.println("Disconnected from the server.");
-        _parent->onPeripheralDisconnected(pClient);
+        if (!_parent->disconnectedClients.push(pClient))
+            Serial.println("Disconnect queue full!");
     }
 private:
     BLEClientMulti* _parent;
@@ -71,77 +124,241 @@ NimBLEClient* BLEClientMulti::getClientForDamper(int damperIndex) const {
     return nullptr;
 }
 
-void BLEClientMulti::connectToDevice() {
-    if (isTargetDevice(MyAdvertisedDevice)) {
-        // Serial.println("BLE Target device found.");
-        NimBLEClient* pClient;
-        pClient = NimBLEDevice::createClient();
-        pClient->setClientCallbacks(new ClientCallbacks(this)); // Set client callbacks
-        if (pClient->connect(MyAdvertisedDevice, true)) {
-            NimBLERemoteService* pRemoteService = pClient->getService(SERVICE_UUID);
-
-            if (pRemoteService) {
-                // Get the server MAC address
-                std::string serverMac = MyAdvertisedDevice->getAddress().toString();
-                notify_characteristic(pRemoteService, VOLTAGE_UUID, serverMac);
-                // Store the client in the map
-                std::string server_name = getIndexFromMac(serverMac);
-                // if (server_name=="AC") AC_CONNECTED = true; 
-                // else if (server_name=="PARENTS_ROOM_DUMPER") PARENTS_ROOM_DUMPER_CONNECTED = true;
-                // else if (server_name=="WORKING_ROOM_DUMPER") WORKING_ROOM_DUMPER_CONNECTED = true;
-                // else if (server_name=="SAFE_ROOM_DUMPER") SAFE_ROOM_DUMPER_CONNECTED = true;
-                Serial.printf("Adding client for device: %s\n", server_name.c_str());
-                clients[serverMac] = pClient;
-
-                int i = -1;          
-                if (server_name=="AC") i = 0; 
-                else if (server_name=="PARENTS_ROOM_DUMPER") i = 1;
-                else if (server_name=="WORKING_ROOM_DUMPER") i = 2;
-                else if (server_name=="SAFE_ROOM_DUMPER") i = 3;;
-                if (pendingCommands[i].pending) 
-                {
-                    NimBLERemoteCharacteristic* pChar = pRemoteService->getCharacteristic(pendingCommands[i].characteristicUUID);
-                    if (pChar) {
-                        pChar->writeValue(pendingCommands[i].value);
-                        Serial.println("Executed pending command");
-                        pendingCommands[i].pending = false;
-                    }
-                }
-            }
-        } else {
+bool BLEClientMulti::processScanResults() {
+    bool attempted = false;
+    ScanResult result;
+    // One attempt at a time: the others are heard again once it completes
+    while (!connectingClient && scanResults.pop(result)) {
+        if (getClientForIdentifier(result.address.toString())) continue;  // Already connected
+        attempted = connectToDevice(result);
+    }
+    if (connectingClient) return attempted;  // The scan is restarted when the attempt completes
+    // A connection attempt stops the scan; restart it from here only, never from the host task
+    if (scanEnded.exchange(false, std::memory_order_acquire))    startScanning();
+    return attempted;
+}
+
+bool BLEClientMulti::connectToDevice(const ScanResult& result) {
+    // Get the server MAC address
+    const int device = getDeviceIndex(result.address.toString());
+    const int rssi = result.rssi;
+    if (connectFilter && !connectFilter(device, rssi)) return false;
+    if (!supervisor.mayAttempt(device, rssi, millis())) return false;
+    NimBLEClient* pClient;
+    pClient = NimBLEDevice::createClient();
+    pClient->setClientCallbacks(new ClientCallbacks(this)); // Set client callbacks
+    pClient->setConnectTimeout(CONNECT_TIMEOUT_MS);
+    // Asynchronous: the BLE task keeps executing commands while the link is established
+    if (!pClient->connect(result.address, true, true)) {
+        Serial.println("Unable to connect to BLE peripheral.");
+        supervisor.onConnectFailed(device, millis());
+        NimBLEDevice::deleteClient(pClient); // Corrected deletion
+        startScanning();
+        return false;
+    }
+    connectingClient = pClient;
+    connectingDevice = device;
+    return true;
+}
+
+bool BLEClientMulti::processConnects() {
+    bool connected = false;
+    ConnectResult result;
+    while (connectResults.pop(result)) {
+        if (!connectingClient || result.client != connectingClient) continue;  // Stale
+        NimBLEClient* pClient = connectingClient;
+        const int device = connectingDevice;
+        connectingClient = nullptr;
+        connectingDevice = -1;
+        if (result.connected)   connected = finishConnect(pClient, device, result.linkUpUs);
+        else {
             Serial.println("Unable to connect to BLE peripheral.");
-            NimBLEDevice::deleteClient(pClient); // Corrected deletion
+            supervisor.onConnectFailed(device, millis());
+            NimBLEDevice::deleteClient(pClient);
         }
+        scanEnded.store(false, std::memory_order_relaxed);
+        startScanning();
+    }
+    return connected;
+}
+
+bool BLEClientMulti::finishConnect(NimBLEClient* pClient, int device, int64_t linkUpUs) {
+    std::string serverMac = pClient->getPeerAddress().toString();
+    if (!pClient->isConnected()) {
+        // Dropped before the setup: its disconnect was already processed and ignored
+        Serial.println("Link lost during setup.");
+        supervisor.onConnectFailed(device, millis());
+        NimBLEDevice::deleteClient(pClient);
+        return false;
+    }
+    NimBLERemoteService* pRemoteService = pClient->getService(SERVICE_UUID);
+    if (!pRemoteService) {
+        // Not usable without the service: count it as a failed attempt instead of leaking the link
+        Serial.println("Service NOT found, disconnecting.");
+        supervisor.onConnectFailed(device, millis());
+        closeClient(pClient);
+        return false;
+    }
+    notify_characteristic(pRemoteService, VOLTAGE_UUID, serverMac);
+    // Store the client in the map
+    std::string server_name = getIndexFromMac(serverMac);
+    // if (server_name=="AC") AC_CONNECTED = true; 
+    // else if (server_name=="PARENTS_ROOM_DUMPER") PARENTS_ROOM_DUMPER_CONNECTED = true;
+    // else if (server_name=="WORKING_ROOM_DUMPER") WORKING_ROOM_DUMPER_CONNECTED = true;
+    // else if (server_name=="SAFE_ROOM_DUMPER") SAFE_ROOM_DUMPER_CONNECTED = true;
+    Serial.printf("Adding client for device: %s\n", server_name.c_str());
+    clients[serverMac] = pClient;
+    supervisor.onConnected(device, millis());
+
+    int i = device;
+    if (i >= 0 && i < MAX_CLIENTS) {
+        links[i].profile = LINK_DEFAULT;
+        links[i].lastActivityMs = millis();
+    }
+    if (onLinkChanged) onLinkChanged(i, true);
+    // Discovery blocked the task: run what was queued meanwhile before the reads block it again.
+    // Not between the reads, so no command changes a value after it was read back.
+    if (runCommands) runCommands();
+    // Read back the control values; pending commands are replayed during reconciliation
+    if (i >= 0 && i < MAX_CLIENTS && pClient->isConnected()) {
+        markActivity(i);
+        readControlState(i, pRemoteService, linkUpUs);
     }
+    return true;
 }
 
 bool BLEClientMulti::isTargetDevice(NimBLEAdvertisedDevice* advertisedDevice) {
-    std::string address = advertisedDevice->getAddress().toString();
-    std::string name = advertisedDevice->getName();
-    for (const auto& target : targetDevices)
-        if (target == address || target == name)    return true;
-    return false;
+    return isTargetIdentifier(advertisedDevice->getAddress().toString(), advertisedDevice->getName());
+}
+
+bool BLEClientMulti::isTargetIdentifier(const std::string& address, const std::string& name) const {
+    return ::isTargetIdentifier(targetDevices, address, name);
+}
+
+void BLEClientMulti::closeClient(NimBLEClient* pClient) {
+    for (auto& closing : closingClients) {
+        if (!closing) {
+            closing = pClient;
+            pClient->disconnect();
+            return;
+        }
+    }
+    // No slot to wait for its disconnect event in: drop it now, the event is ignored later
+    NimBLEDevice::deleteClient(pClient);
 }
 
 // New method to handle peripheral disconnection
 void BLEClientMulti::onPeripheralDisconnected(NimBLEClient* pClient) {
     // Serial.println("Handling peripheral disconnection...");
-    pClient->disconnect();
-    NimBLEDevice::deleteClient(pClient);
+    for (auto& closing : closingClients) {
+        if (closing == pClient) {
+            closing = nullptr;
+            NimBLEDevice::deleteClient(pClient);
+            return;
+        }
+    }
     // Remove the client from the map
     for (auto it = clients.begin(); it != clients.end(); ++it) {
         if (it->second == pClient) {
+            // A connected client at this address is a newer one: the event was for a deleted client
+            if (pClient->isConnected()) return;
+            NimBLEDevice::deleteClient(pClient);
             // Serial.printf("Removing client for device: %s\n", it->first.c_str());
             // if (it->first == "AC") AC_CONNECTED  = false;
             // else if (it->first == "PARENTS_ROOM_DUMPER") PARENTS_ROOM_DUMPER_CONNECTED = false;
             // else if (it->first == "WORKING_ROOM_DUMPER") WORKING_ROOM_DUMPER_CONNECTED = false;
             // else if (it->first == "SAFE_ROOM_DUMPER") SAFE_ROOM_DUMPER_CONNECTED = false;
+            const int device = getDeviceIndex(it->first);
+            supervisor.onDisconnected(device, millis());
+            if (onLinkChanged) onLinkChanged(device, false);
             clients.erase(it);
             break;
         }
     }
 }
 
+void BLEClientMulti::readControlState(int device, NimBLERemoteService* pService, int64_t linkUpUs) {
+    ControlSnapshot& snapshot = snapshots[device];
+    snapshot.linkUpUs = linkUpUs;
+    for (int field = 0; field < CONTROL_COUNT; ++field) {
+        snapshot.valid[field] = false;
+        NimBLERemoteCharacteristic* pChar = pService->getCharacteristic(controlUUIDs[field]);
+        if (!pChar || !pChar->canRead()) continue;
+        if (!readCharacteristic(pService->getClient(), pChar, snapshot.values[field], CONTROL_VALUE_SIZE)) continue;
+        snapshot.valid[field] = snapshot.values[field][0] != '\0';
+    }
+    snapshot.ready = true;
+}
+
+bool BLEClientMulti::readCharacteristic(NimBLEClient* pClient, NimBLERemoteCharacteristic* pCharacteristic, char* value, size_t size) {
+    value[0] = '\0';
+    if (!pClient || !pCharacteristic->canRead()) return false;
+    if (!readDone) readDone = xSemaphoreCreateBinaryStatic(&readDoneBuffer);
+    xSemaphoreTake(readDone, 0);  // Left over from a read that completed after timing out
+    portENTER_CRITICAL(&readLock);
+    const uint32_t generation = ++readGeneration;
+    readBuffer = value;
+    readBufferSize = size;
+    readStatus = BLE_HS_ETIMEOUT;
+    portEXIT_CRITICAL(&readLock);
+    const bool issued = ble_gattc_read(pClient->getConnHandle(), pCharacteristic->getHandle(), onReadComplete,
+                                       reinterpret_cast<void*>((uintptr_t)generation)) == 0;
+    const bool completed = issued && xSemaphoreTake(readDone, pdMS_TO_TICKS(READ_TIMEOUT_MS)) == pdTRUE;
+    portENTER_CRITICAL(&readLock);
+    readGeneration++;  // From here on a late completion is dropped
+    const bool ok = completed && readStatus == 0;
+    readBuffer = nullptr;
+    portEXIT_CRITICAL(&readLock);
+    if (!ok) value[0] = '\0';
+    return ok;
+}
+
+bool BLEClientMulti::setLinkProfile(int device, LinkProfile profile) {
+    if (device < 0 || device >= MAX_CLIENTS || profile == LINK_DEFAULT) return false;
+    NimBLEClient* pClient = getClientForDamper(device);
+    if (!pClient || !pClient->isConnected()) return false;
+    const bool lowLatency = (profile == LINK_LOW_LATENCY);
+    const bool requested = lowLatency
+        ? pClient->updateConnParams(LOW_LATENCY_MIN_INTERVAL, LOW_LATENCY_MAX_INTERVAL, LOW_LATENCY_SLAVE_LATENCY, LOW_LATENCY_TIMEOUT)
+        : pClient->updateConnParams(POWER_SAVE_MIN_INTERVAL, POWER_SAVE_MAX_INTERVAL, POWER_SAVE_SLAVE_LATENCY, POWER_SAVE_TIMEOUT);
+    if (requested) links[device].profile = profile;
+    else Serial.printf("Connection parameter update failed for device %d\n", device);
+    return requested;
+}
+
+LinkProfile BLEClientMulti::markActivity(int device) {
+    if (device < 0 || device >= MAX_CLIENTS) return LINK_DEFAULT;
+    const LinkProfile previous = links[device].profile;
+    links[device].lastActivityMs = millis();
+    if (previous != LINK_LOW_LATENCY) setLinkProfile(device, LINK_LOW_LATENCY);
+    return previous;
+}
+
+void BLEClientMulti::relaxIdleLinks() {
+    const uint32_t now = millis();
+    for (int i = 0; i < MAX_CLIENTS; ++i)
+        if (links[i].profile != LINK_POWER_SAVE && now - links[i].lastActivityMs >= LINK_IDLE_MS && getClientForDamper(i))
+            setLinkProfile(i, LINK_POWER_SAVE);
+}
+
+void BLEClientMulti::printLinkStats() const {
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        NimBLEClient* pClient = getClientForDamper(i);
+        if (!pClient || !pClient->isConnected()) continue;
+        NimBLEConnInfo info = pClient->getConnInfo();
+        Serial.printf("[stats] link %d  %-11s  interval %.2f ms  latency %u  timeout %u ms  rssi %d\n", i,
+                      linkProfileNames[links[i].profile], info.getConnInterval() * 1.25f, info.getConnLatency(),
+                      info.getConnTimeout() * 10, pClient->getRssi());
+    }
+    supervisor.printStats();
+}
+
+void BLEClientMulti::processDisconnects() {
+    NimBLEClient* pClient;
+    while (disconnectedClients.pop(pClient))
+        onPeripheralDisconnected(pClient);
+}
+
 bool BLEClientMulti::isConnected() const {
     for (const auto& pair : clients)
     {
@@ -157,25 +374,20 @@ void BLEClientMulti::notify_characteristic(NimBLERemoteService* pService, const
     // Enable notifications for the characteristic
     NimBLERemoteCharacteristic* pCharacteristic = pService->getCharacteristic(characteristic_uuid);
     if (pCharacteristic) {
-        pCharacteristic->subscribe(true, [serverMac](NimBLERemoteCharacteristic* pCharacteristic, const uint8_t* pData, size_t length, bool isNotify)
+        const int index = getDeviceIndex(serverMac);
+        if (index < 0) Serial.println("Subscribing to unknown device!");
+        // The callback runs on the NimBLE host task: decode the payload (binary or text) in place and queue it
+        pCharacteristic->subscribe(true, [this, index](NimBLERemoteCharacteristic* pCharacteristic, const uint8_t* pData, size_t length, bool isNotify)
         {
-            std::string voltage(reinterpret_cast<const char*>(pData), length);
-            notified = true;
-            per_voltage = voltage;
-            Serial.println(serverMac.c_str());
-            // Switch case for different MAC addresses
-            if (serverMac == AC_MAC)                        notifty_index = 0;
-            else if (serverMac == PARENTS_ROOM_DUMPER_MAC)  notifty_index = 1;
-            else if (serverMac == WORKING_ROOM_DUMPER_MAC)  notifty_index = 2;
-            else if (serverMac == SAFE_ROOM_DUMPER_MAC)     notifty_index = 3;
-            else if (serverMac == TEST1_MAC)                notifty_index = 4;
-            else if (serverMac == TEST2_MAC)                notifty_index = 5;
-            else  Serial.println("Notified from unknown device!");
-
-            Serial.print("Notified Data: ");
-            Serial.println(voltage.c_str());
-            Serial.print("Server MAC: ");
-            Serial.println(serverMac.c_str());
+            if (index < 0) return;
+            VoltageNotification notification;
+            notification.index = (int8_t)index;
+            notification.format = decodeVoltage(pData, length, notification.millivolts, notification.flags);
+            if (notification.format == VOLTAGE_INVALID) {
+                invalidVoltagePayloads.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            notifications.push(notification);
         });
     }
     else  Serial.println("Characteristic NOT found!");
@@ -11,6 +11,11 @@
 #include <map>
 #include "Arduino.h"
 #include <unordered_map> // Include for dynamic client storage
+#include <atomic>
+#include "spsc_queue.h"
+#include "voltage_codec.h"
+#include "reconnect_supervisor.h"
+#include "controls.h"
 
 // UUIDs for BLE services and characteristics
 #define SERVICE_UUID "5678abcd-0000-1000-8000-00805f9b34fb"
@@ -20,32 +25,67 @@
 #define TEMP_UUID "5678abcd-0004-1000-8000-00805f9b34fb"
 #define VOLTAGE_UUID "5678abcd-0005-1000-8000-00805f9b34fb"
 
-// BLE MAC addresses for specific devices
-static const char* AC_MAC = "64:e8:33:8c:04:a6"; // Air Conditioner
-static const char* PARENTS_ROOM_DUMPER_MAC = "9c:9e:6e:c1:09:e2"; // Parents room damper
-static const char* WORKING_ROOM_DUMPER_MAC = "9c:9e:6e:c1:0c:5e"; // Working room damper
-static const char* TEST1_MAC = "64:e8:33:8a:7c:be"; // Safe room damper
-static const char* TEST2_MAC = "DC:06:75:E9:6F:92"; // Redundant Controller
-static const char* SAFE_ROOM_DUMPER_MAC = "DC:06:75:E9:3C:02"; // Tests Controller
-
-
-// Map of damper indices to their corresponding MAC addresses
-static const std::unordered_map<int, std::string> damperMacMap = {
-    {0, AC_MAC},
-    {1, PARENTS_ROOM_DUMPER_MAC},
-    {2, WORKING_ROOM_DUMPER_MAC},
-    {3, SAFE_ROOM_DUMPER_MAC},
-    {4, TEST1_MAC},
-    {5, TEST2_MAC}
+// Characteristic of each ControlField (see controls.h)
+static const char* const controlUUIDs[CONTROL_COUNT] = {STATE_UUID, VENT_SPEED_UUID, MODE_UUID, TEMP_UUID};
+
+/**
+ * @brief Control values read back from a peripheral right after it connected.
+ */
+struct ControlSnapshot {
+    bool ready;                                          ///< Read and waiting to be reconciled
+    bool valid[CONTROL_COUNT];                           ///< Whether the characteristic could be read
+    char values[CONTROL_COUNT][CONTROL_VALUE_SIZE];      ///< Values as reported by the peripheral
+    int64_t linkUpUs;                                    ///< esp_timer time when the connection was established
+};
+
+// Connection parameter profiles (interval in 1.25 ms units, timeout in 10 ms units).
+// Low latency while a device is being commanded, power save when idle so Wi-Fi gets the radio.
+#define LOW_LATENCY_MIN_INTERVAL 6     // 7.5 ms
+#define LOW_LATENCY_MAX_INTERVAL 12    // 15 ms
+#define LOW_LATENCY_SLAVE_LATENCY 0
+#define LOW_LATENCY_TIMEOUT 200        // 2 s
+#define POWER_SAVE_MIN_INTERVAL 80     // 100 ms
+#define POWER_SAVE_MAX_INTERVAL 160    // 200 ms
+#define POWER_SAVE_SLAVE_LATENCY 4
+#define POWER_SAVE_TIMEOUT 600         // 6 s
+#define LINK_IDLE_MS 30000             // Idle time before a link drops to power save
+#define CONNECT_TIMEOUT_MS 2000        // A connection attempt (asynchronous) is given up after this long
+#define READ_TIMEOUT_MS 2000           // A characteristic read blocks the BLE task for at most this long
+
+/**
+ * @brief Per-device link profile state (BLE task only).
+ */
+struct LinkState {
+    LinkProfile profile;
+    uint32_t lastActivityMs;  ///< millis() of the last command sent to the device
 };
 
-struct PendingCommand {
-    NimBLEUUID characteristicUUID;
-    std::string value;
-    bool pending;
+/**
+ * @brief An advertisement of a target device handed from the NimBLE host task to the BLE task.
+ */
+struct ScanResult {
+    NimBLEAddress address;  ///< Address (with its type) to connect to
+    int8_t rssi;            ///< Advertisement RSSI in dBm
+};
+
+/**
+ * @brief Outcome of an asynchronous connection attempt handed from the NimBLE host task to the BLE task.
+ */
+struct ConnectResult {
+    NimBLEClient* client;  ///< The client of the attempt; compared only, it may have been deleted since
+    bool connected;        ///< False if the attempt failed or timed out
+    int64_t linkUpUs;      ///< esp_timer time when the link came up
 };
 
-#define MAX_CLIENTS 4  // Adjust based on your max number of BLE clients
+/**
+ * @brief A decoded voltage notification handed from the NimBLE host task to the BLE task.
+ */
+struct VoltageNotification {
+    int8_t index;         ///< Device index (see damperMacMap)
+    uint8_t format;       ///< VoltageFormat the peripheral used
+    uint8_t flags;        ///< Flags from a binary payload, 0 for text
+    uint16_t millivolts;  ///< Voltage in millivolts
+};
 
 
 /**
@@ -56,13 +96,22 @@ class BLEClientMulti {
 public:
     NimBLEScan* pBLEScan{}; ///< Pointer to the BLE scanner instance.
     std::unordered_map<std::string, NimBLEClient*> clients; ///< Map to store BLE clients by MAC address or identifier.
-    NimBLEAdvertisedDevice* MyAdvertisedDevice{}; ///< Pointer to the currently advertised BLE device.
-    std::vector<std::string> targetDevices; ///< List of target devices to connect to.
-    bool doConnect = false; ///< Flag indicating whether to initiate a connection.
-    static bool notified; ///< Static flag indicating if a notification was received.
-    static std::string per_voltage; ///< Static variable to store the voltage value from the peripheral.
-    static int notifty_index; ///< Static variable to store the index of the notifying device.
-    PendingCommand pendingCommands[MAX_CLIENTS];
+    std::vector<std::string> targetDevices; ///< List of target devices to connect to (set up by init(), read-only afterwards).
+    SpscQueue<ScanResult, 16> scanResults; ///< Target advertisements, filled by the NimBLE host task, drained by the BLE task.
+    std::atomic<bool> scanEnded{false}; ///< Set by the NimBLE host task when a scan ends; the BLE task restarts it.
+    SpscQueue<VoltageNotification, 16> notifications; ///< Filled by the NimBLE host task, drained by the BLE task.
+    SpscQueue<NimBLEClient*, 8> disconnectedClients; ///< Filled by the NimBLE host task, drained by the BLE task; may hold stale pointers.
+    SpscQueue<ConnectResult, 4> connectResults; ///< Filled by the NimBLE host task, drained by the BLE task.
+    NimBLEClient* connectingClient = nullptr; ///< The connection attempt in progress, at most one (BLE task only).
+    int connectingDevice = -1; ///< Device index of connectingClient.
+    NimBLEClient* closingClients[MAX_CLIENTS] = {}; ///< Clients disconnected on purpose before being added to `clients` (BLE task only).
+    std::atomic<uint32_t> invalidVoltagePayloads{0}; ///< Voltage notifications that could not be decoded.
+    LinkState links[MAX_CLIENTS] = {}; ///< Connection parameter profile per device.
+    ControlSnapshot snapshots[MAX_CLIENTS] = {}; ///< Control values read on connect, for reconciliation.
+    void (*onLinkChanged)(int device, bool connected) = nullptr; ///< Called from the BLE task when a peripheral connects or disconnects.
+    bool (*connectFilter)(int device, int rssi) = nullptr; ///< Called from the BLE task before connecting to a target device; return false to skip it.
+    void (*runCommands)() = nullptr; ///< Called from the BLE task while a new link is set up, before its control values are read, to execute queued commands.
+    ReconnectSupervisor supervisor; ///< Decides when a device is worth a connection attempt (BLE task only).
 
     // bool AC_CONNECTED = false; // Flag to track if AC is connected
     // bool PARENTS_ROOM_DUMPER_CONNECTED = false; // Flag to track if Parents room damper is connected
@@ -85,14 +134,43 @@ public:
     void addTargetDevice(const std::string& identifier);
 
     /**
-     * @brief Start scanning for BLE devices.
+     * @brief Start scanning for BLE devices (BLE task, or before it starts).
      */
     void startScanning() const;
 
     /**
-     * @brief Connect to a target BLE device.
+     * @brief Start connecting to a target device found by the scan and restart the scan (BLE task only).
+     * @return True if a connection attempt was started.
+     */
+    bool processScanResults();
+
+    /**
+     * @brief Start an asynchronous connection to an advertised target device (BLE task only).
+     *
+     * Returns as soon as the attempt is started; processConnects() finishes it.
+     *
+     * @param result The advertisement queued by the scan callback.
+     * @return True if the attempt was started.
+     */
+    bool connectToDevice(const ScanResult& result);
+
+    /**
+     * @brief Finish the connection attempt reported by the client callbacks, and restart the scan (BLE task only).
+     * @return True if a device was connected and set up.
      */
-    void connectToDevice();
+    bool processConnects();
+
+    /**
+     * @brief Set up a freshly connected client: discovery, subscription, control value reads (BLE task only).
+     *
+     * Queued commands are executed (runCommands) between the discovery and the reads.
+     *
+     * @param pClient The connected client.
+     * @param device The device index.
+     * @param linkUpUs esp_timer time when the link came up.
+     * @return True if the client was added to `clients`.
+     */
+    bool finishConnect(NimBLEClient* pClient, int device, int64_t linkUpUs);
 
     /**
      * @brief Check if the advertised device is a target device.
@@ -101,12 +179,91 @@ public:
      */
     bool isTargetDevice(NimBLEAdvertisedDevice* advertisedDevice);
 
+    /**
+     * @brief Check if an address or name belongs to a target device.
+     * @param address The advertised MAC address.
+     * @param name The advertised name.
+     * @return True if either matches a target device.
+     */
+    bool isTargetIdentifier(const std::string& address, const std::string& name) const;
+
     /**
      * @brief Handle the event when a peripheral device is disconnected.
+     *
+     * The pointer comes from the disconnect queue and may be stale: a client
+     * that failed to connect was deleted already, and its address may have been
+     * reused. Only clients still in `clients` (and no longer connected) or in
+     * closingClients are torn down; anything else is ignored.
+     *
      * @param pClient Pointer to the BLE client that was disconnected.
      */
     void onPeripheralDisconnected(NimBLEClient* pClient);
 
+    /**
+     * @brief Clean up clients queued by the disconnect callback.
+     *
+     * `clients` is owned by the BLE task: callbacks running on the NimBLE host
+     * task only enqueue, and the BLE task applies the change here.
+     */
+    void processDisconnects();
+
+    /**
+     * @brief Disconnect a client that never made it into `clients`; it is deleted once its disconnect is processed.
+     */
+    void closeClient(NimBLEClient* pClient);
+
+    /**
+     * @brief Read every control characteristic of a freshly connected device into snapshots.
+     *
+     * ATT allows one outstanding request per link, so the reads are issued back to back
+     * on the already discovered characteristics while the link is in the low-latency profile.
+     *
+     * @param device The device index.
+     * @param pService The discovered service of the device.
+     * @param linkUpUs esp_timer time when the connection was established.
+     */
+    void readControlState(int device, NimBLERemoteService* pService, int64_t linkUpUs);
+
+    /**
+     * @brief Read a characteristic into a caller-provided buffer (BLE task only).
+     *
+     * readValue() returns a heap-backed NimBLEAttValue; this issues the ATT read
+     * directly and copies the response into the buffer, so it does not allocate.
+     *
+     * @param pClient The connected client.
+     * @param pCharacteristic The characteristic to read.
+     * @param value Receives the value, NUL-terminated; set to an empty string on failure.
+     * @param size Size of the buffer in bytes.
+     * @return False if the read failed or timed out, or the value does not fit.
+     */
+    static bool readCharacteristic(NimBLEClient* pClient, NimBLERemoteCharacteristic* pCharacteristic, char* value, size_t size);
+
+    /**
+     * @brief Request a connection parameter profile for a connected device.
+     * @param device The device index.
+     * @param profile The profile to switch to.
+     * @return True if the update was requested (it takes effect a few connection events later).
+     */
+    bool setLinkProfile(int device, LinkProfile profile);
+
+    /**
+     * @brief Record command activity on a device and switch it to the low-latency profile.
+     * @param device The device index.
+     * @return The profile the link had before the call.
+     */
+    LinkProfile markActivity(int device);
+
+    /**
+     * @brief Switch links without recent activity to the power-save profile.
+     */
+    void relaxIdleLinks();
+
+    /**
+     * @brief Print the profile and current connection parameters of each connected device,
+     *        and the reconnect counters of every device.
+     */
+    void printLinkStats() const;
+
     /**
      * @brief Check if any BLE client is currently connected.
      * @return True if a client is connected, false otherwise.
@@ -135,29 +292,19 @@ public:
      */
     NimBLEClient* getClientForIdentifier(const std::string& identifier) const;
 
+    /**
+     * @brief Get the device index (key of damperMacMap) for a MAC address.
+     * @param mac The MAC address to look up.
+     * @return The device index, or -1 if the MAC is not known.
+     */
+    static int getDeviceIndex(const std::string& mac) { return deviceIndexOfMac(mac); }
+
     /**
      * @brief Get the index for a given MAC address
      * @param mac The MAC address to look up in the damperMacMap
      * @return The index corresponding to the MAC address, or -1 if not found
      */
-    static std::string getIndexFromMac(const std::string& mac) {
-        for (const auto& pair : damperMacMap) {
-            if (pair.second == mac) 
-            {
-                switch (pair.first) {
-                    case 0:
-                        return "AC"; // 
-                    case 1:
-                        return "PARENTS_ROOM_DUMPER"; // Parents room damper
-                    case 2:
-                        return "WORKING_ROOM_DUMPER"; // Working room damper    
-                    case 3: 
-                        return "SAFE_ROOM_DUMPER_MAC"; // Safe room damper 
-                }
-            }
-        }
-        return "None";
-    }
+    static std::string getIndexFromMac(const std::string& mac) { return deviceNameOfMac(mac); }
 };
 
 #endif
@@ -0,0 +1,77 @@
+#ifndef BOOT_TIMELINE_H
+#define BOOT_TIMELINE_H
+
+#include "Arduino.h"
+
+/**
+ * @brief Milestones recorded while the gateway boots.
+ */
+enum BootStage : uint8_t {
+    BOOT_WIFI_BEGIN = 0,     ///< Wi-Fi association started (non-blocking)
+    BOOT_NVS_READY,          ///< NVS flash initialised
+    BOOT_SPIFFS_READY,       ///< SPIFFS mounted
+    BOOT_BLE_SCANNING,       ///< BLE stack initialised and scanning
+    BOOT_SERVER_READY,       ///< HTTP and WebSocket servers listening
+    BOOT_WIFI_CONNECTED,     ///< Station got an IP address
+    BOOT_BLE_CONNECTED,      ///< First BLE peripheral connected
+    BOOT_FIRST_COMMAND,      ///< First command received over WebSocket or Blynk
+    BOOT_STAGE_COUNT
+};
+
+static const char* const bootStageNames[BOOT_STAGE_COUNT] = {
+    "wifi_begin",
+    "nvs_ready",
+    "spiffs_ready",
+    "ble_scanning",
+    "server_ready",
+    "wifi_connected",
+    "ble_connected",
+    "first_command"
+};
+
+/**
+ * @class BootTimeline
+ * @brief Records the time (ms since power-up) at which each boot stage is first reached.
+ *
+ * Only the first mark of each stage is kept, so it is safe to call mark() from
+ * code paths that run repeatedly (e.g. the BLE loop).
+ */
+class BootTimeline {
+public:
+    /**
+     * @brief Record a boot stage if it has not been reached yet.
+     * @param stage The stage that was reached.
+     */
+    void mark(BootStage stage) {
+        if (stage >= BOOT_STAGE_COUNT || reached[stage]) return;
+        stamps[stage] = millis();
+        reached[stage] = true;
+        Serial.printf("[boot] %-16s +%lu ms\n", bootStageNames[stage], (unsigned long)stamps[stage]);
+    }
+
+    /**
+     * @brief Check whether a stage has been reached.
+     * @param stage The stage to check.
+     * @return True if the stage was marked.
+     */
+    bool hasReached(BootStage stage) const {
+        return stage < BOOT_STAGE_COUNT && reached[stage];
+    }
+
+    /**
+     * @brief Print every recorded stage to the serial console.
+     */
+    void print() const {
+        Serial.println("[boot] timeline:");
+        for (int i = 0; i < BOOT_STAGE_COUNT; ++i) {
+            if (reached[i]) Serial.printf("  %-16s +%lu ms\n", bootStageNames[i], (unsigned long)stamps[i]);
+            else            Serial.printf("  %-16s   (pending)\n", bootStageNames[i]);
+        }
+    }
+
+private:
+    uint32_t stamps[BOOT_STAGE_COUNT] = {0};
+    bool reached[BOOT_STAGE_COUNT] = {false};
+};
+
+#endif // BOOT_TIMELINE_H
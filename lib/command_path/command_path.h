@@ -0,0 +1,481 @@
+#ifndef COMMAND_PATH_H
+#define COMMAND_PATH_H
+
+#ifdef ARDUINO
+#include "Arduino.h"
+#include <esp_timer.h>
+#else
+#include <chrono>
+#endif
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "controls.h"
+#include "federation.h"
+#include "fixed_string.h"
+#include "latency_stats.h"
+#include "state_store.h"
+
+// Command execution on the BLE task: the gateway view of every device, the
+// status messages, the saved states and the writes to the peripherals.
+//
+// The peripherals are only reached through a ControlLink and the saved states
+// through a StateStore, so the same code runs on the host against fakes
+// (test/test_command_path). The firmware attaches the NimBLE links, NVS and
+// the event queue (see attachCommandPath in global_var.h).
+
+#ifdef ARDUINO
+#define COMMAND_LOG(...) Serial.printf(__VA_ARGS__)
+#else
+#define COMMAND_LOG(...) ((void)0)
+#endif
+
+/**
+ * @brief Microseconds for command timestamps and latencies (esp_timer on the device), wrapping.
+ */
+inline uint32_t commandClockUs() {
+#ifdef ARDUINO
+    return (uint32_t)esp_timer_get_time();
+#else
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/**
+ * @brief Command kinds parsed by the network task and executed by the BLE task.
+ */
+enum CommandKind : uint8_t {
+    CMD_TOGGLE,     ///< Flip the on/off state of a device
+    CMD_SET_STATE,  ///< Set the on/off state of a device ("on" / "off")
+    CMD_POWER,      ///< Set the vent speed of a device
+    CMD_MODE,       ///< Set the AC mode
+    CMD_TEMP,       ///< Set the AC temperature
+    CMD_WAKE,       ///< A user is about to send commands: switch all links to low latency
+    CMD_TRACE_SNAPSHOT  ///< A traffic recording started: record the device states (BLE task, not executed)
+};
+
+/**
+ * @brief A parsed command (network task -> BLE task).
+ */
+struct GatewayCommand {
+    CommandKind kind;
+    int8_t device;   ///< Device index: 0 = AC, 1..3 = dampers
+    char value[12];  ///< Command argument (empty for CMD_TOGGLE)
+    uint32_t enqueuedUs;  ///< commandClockUs() when the command was queued
+    uint8_t originGateway;  ///< Gateway that forwarded the command, FEDERATION_NO_OWNER if local
+    uint16_t originSeq;     ///< Sequence number of the forwarded command
+    uint32_t traceSeq;      ///< Sequence number of the recorded frame it was parsed from, 0 if none
+};
+
+/**
+ * @brief The device index of a damper number ("1".."3"), -1 if out of range.
+ */
+int damperDevice(const char* number) {
+    const int damper = atoi(number);
+    return damper >= 1 && damper < MAX_CLIENTS ? damper : -1;
+}
+
+/**
+ * @brief Parses a device command message from a client.
+ *
+ * "toggle_ac", "toggle_damper<n>", "power_ac...p_high", "power_damper<n>...p_high",
+ * "set_ac_mode:<mode>", "set_ac_temp:<temp>". Dampers are numbered 1..3.
+ *
+ * @param message The message, NUL-terminated.
+ * @param length The length of the message.
+ * @param kind Receives the command kind.
+ * @param device Receives the device index (0 = AC, 1..3 = dampers).
+ * @param value Receives the command argument, pointing into the message ("" for toggles).
+ * @return False if the message is not a valid device command.
+ */
+bool parseCommand(const char* message, size_t length, CommandKind& kind, int& device, const char*& value) {
+    value = "";
+    if (startsWith(message, "toggle"))
+    {
+        kind = CMD_TOGGLE;
+        if (startsWith(message, "toggle_damper"))   device = damperDevice(message + 13);  // e.g. "1" for damper1
+        else if (startsWith(message, "toggle_ac"))  device = 0;
+        else                                        return false;
+    }
+    else if (startsWith(message, "power"))
+    {
+        if (length < 6) return false;
+        kind = CMD_POWER;
+        value = message + length - 6;  // Power values are 6 characters (e.g., "p_high")
+        if (startsWith(message, "power_damper"))    device = damperDevice(message + 12);
+        else if (startsWith(message, "power_ac"))   device = 0;
+        else                                        return false;
+    }
+    else if (startsWith(message, "set_ac_mode") || startsWith(message, "set_ac_temp"))  // Heat or cold / degrees
+    {
+        if (length <= 12) return false;
+        kind = message[7] == 'm' ? CMD_MODE : CMD_TEMP;
+        device = 0;
+        value = message + 12;
+    }
+    else
+        return false;
+    return device >= 0 && device < MAX_CLIENTS;
+}
+
+/**
+ * @brief How commands are written to the peripherals.
+ */
+enum WriteMode : uint8_t {
+    WRITE_ACKED = 0,   ///< Write request: one ATT round trip per command
+    WRITE_PIPELINED,   ///< Write command (no response), confirmed by one read per batch
+    WRITE_MODE_COUNT
+};
+
+static const char* const writeModeNames[WRITE_MODE_COUNT] = {"acked", "pipelined"};
+
+#define DEFAULT_WRITE_MODE WRITE_ACKED
+#define MAX_UNCONFIRMED_WRITES 8  // Pipelined writes per device before a confirming read is forced
+
+/**
+ * @class ControlLink
+ * @brief Writes and reads the control characteristics of the peripherals (BLE task only).
+ *
+ * NimBLE clients on the device, a fake in the host tests.
+ */
+class ControlLink {
+public:
+    virtual ~ControlLink() {}
+
+    /**
+     * @brief Record command activity on a device (its link switches to low latency).
+     * @return The link profile in effect before the call.
+     */
+    virtual LinkProfile markActivity(int device) = 0;
+
+    /**
+     * @brief Write a control value.
+     * @param mode The write mode to use; set to the mode actually used, since pipelined
+     *             writes fall back to acked writes on characteristics without write-without-response
+     *             or that cannot be read back to confirm the batch.
+     * @return True if the value was written (acked) or handed to the link (pipelined);
+     *         false if the device is not connected or the write failed.
+     */
+    virtual bool write(int device, int field, const char* value, WriteMode& mode) = 0;
+
+    /**
+     * @brief Read a control value back into a caller-provided buffer, without allocating.
+     * @param value Receives the value, NUL-terminated; set to an empty string on failure.
+     * @param size Size of the buffer in bytes.
+     * @return False if the device is not connected, the read failed or the value does not fit.
+     */
+    virtual bool read(int device, int field, char* value, size_t size) = 0;
+};
+
+StateStore* stateStore = nullptr;    // NVS on the device, a RamStateStore in the benchmarks and host tests
+ControlLink* controlLink = nullptr;  // The peripherals
+// Publishes a status message, caused by a command or (cause == nullptr) by the peripheral (BLE task)
+void (*onControlStatus)(int device, int field, const char* statusMessage, const GatewayCommand* cause) = nullptr;
+
+// Gateway view of each device's control values, indexed by ControlField (BLE task only)
+char deviceState[MAX_CLIENTS][CONTROL_COUNT][CONTROL_VALUE_SIZE];
+// Bit per ControlField: the value in deviceState has not reached the peripheral yet (BLE task only)
+uint8_t pendingFields[MAX_CLIENTS];
+bool stateChanged = true;  // The state document is out of date (BLE task only)
+
+std::atomic<uint8_t> writeMode{DEFAULT_WRITE_MODE};  // Set with "write_mode:" WebSocket messages
+// Command latency, measured from queueCommand() to the end of executeCommand()
+LatencyStats commandLatency;
+// Command-to-write latency (queued until the write was acknowledged or confirmed), by the link profile in effect
+LatencyStats writeLatency[LINK_PROFILE_COUNT];
+// Command latency by write mode: queued until acknowledged (acked) or confirmed by the read back (pipelined)
+LatencyStats commandWriteLatency[WRITE_MODE_COUNT];
+std::atomic<uint32_t> pipelineFallbacks{0};  // Batches re-sent acked because the read back did not match
+std::atomic<uint32_t> commandsExecuted{0};
+
+/**
+ * @brief Saves a key-value pair to the state store (NVS on the device).
+ *
+ * @param key The key to save.
+ * @param state The value to save.
+ */
+void saveState(const char* key, const char* state) {
+    stateStore->write(key, state);
+}
+
+/**
+ * @brief Loads a value from the state store based on the given key.
+ *
+ * @param key The key to retrieve the value for.
+ * @param value Buffer that receives the value; set to an empty string on failure.
+ * @param size Size of the buffer in bytes.
+ * @return True if the value was found and fits in the buffer.
+ */
+bool loadState(const char* key, char* value, size_t size) {
+    return stateStore->read(key, value, size);
+}
+
+/**
+ * @brief Whether a device has a control characteristic (mode and temperature are AC only).
+ */
+bool deviceHasField(int device, int field) {
+    return device == 0 || field == CONTROL_STATE || field == CONTROL_POWER;
+}
+
+/**
+ * @brief Builds the status message sent to clients and the NVS key for a control value.
+ *
+ * @param device The device index.
+ * @param field The control field.
+ * @param value The control value.
+ * @param statusMessage Receives the status message.
+ * @param key Receives the NVS key.
+ */
+void buildStatus(int device, int field, const char* value, FixedString<40>& statusMessage, FixedString<16>& key) {
+    switch (field) {
+        case CONTROL_STATE:
+            if (device == 0)    { statusMessage.append("status_ac:").append(value); key.append("ac_state"); }
+            else                { statusMessage.appendf("status_damper%d:%s", device, value); key.appendf("damper%d_state", device); }
+            break;
+        case CONTROL_POWER:
+            if (device == 0)    { statusMessage.append("power_ac: ").append(value); key.append("ac_power"); }
+            else                { statusMessage.appendf("power_damper%d:%s", device, value); key.appendf("damper%d_power", device); }
+            break;
+        case CONTROL_MODE:
+            statusMessage.append("ac_mode: ").append(value);
+            key.append("ac_mode");
+            break;
+        case CONTROL_TEMP:
+            statusMessage.append("ac_temp: ").append(value);
+            key.append("ac_temp");
+            break;
+    }
+}
+
+/**
+ * @brief The value part of a status message ("status_ac:on", "ac_temp: 24"), or nullptr.
+ */
+const char* statusValue(const char* statusMessage) {
+    const char* value = strchr(statusMessage, ':');
+    if (!value) return nullptr;
+    while (*++value == ' ') {}
+    return value;
+}
+
+/**
+ * @brief Appends a string as a JSON string literal (values come from clients, so they are escaped).
+ */
+template <size_t N>
+void appendJsonString(FixedString<N>& json, const char* text) {
+    json.append("\"");
+    for (const char* c = text; *c; ++c) {
+        if (*c == '"' || *c == '\\')      json.append("\\").append(c, 1);
+        else if ((uint8_t)*c < 0x20)    json.appendf("\\u%04x", (unsigned)(uint8_t)*c);
+        else                            json.append(c, 1);
+    }
+    json.append("\"");
+}
+
+/**
+ * @brief Appends the state document of every device (GET /api/state).
+ *
+ * {"boot":"5c3a01f2","version":7,"devices":[{"id":0,"name":"ac","connected":true,"state":"on","power":"p_high",
+ *  "mode":"heat","temp":"24","voltage_mv":12340}, ...]}
+ *
+ * @param connected Whether each device has a link.
+ * @param millivolts Last voltage of each device, or -1 if it never reported one.
+ */
+template <size_t N>
+void serializeStateDocument(FixedString<N>& json, uint32_t boot, uint32_t version, const bool connected[MAX_CLIENTS],
+                            const int32_t millivolts[MAX_CLIENTS]) {
+    json.appendf("{\"boot\":\"%08lx\",\"version\":%lu,\"devices\":[", (unsigned long)boot, (unsigned long)version);
+    for (int device = 0; device < MAX_CLIENTS; ++device) {
+        if (device == 0)    json.append("{\"id\":0,\"name\":\"ac\"");
+        else                json.appendf(",{\"id\":%d,\"name\":\"damper%d\"", device, device);
+        json.append(",\"connected\":").append(connected[device] ? "true" : "false");
+        for (int field = 0; field < CONTROL_COUNT; ++field) {
+            if (!deviceHasField(device, field)) continue;
+            json.appendf(",\"%s\":", fieldNames[field]);
+            appendJsonString(json, deviceState[device][field]);
+        }
+        if (millivolts[device] >= 0)    json.appendf(",\"voltage_mv\":%u}", (unsigned)millivolts[device]);
+        else                            json.append(",\"voltage_mv\":null}");
+    }
+    json.append("]}");
+}
+
+/**
+ * @brief Publishes a control value to clients and saves it to NVS (BLE task only).
+ */
+void publishControlValue(int device, int field) {
+    FixedString<40> statusMessage;
+    FixedString<16> key;
+    buildStatus(device, field, deviceState[device][field], statusMessage, key);
+    if (onControlStatus) onControlStatus(device, field, statusMessage.c_str(), nullptr);
+    stateChanged = true;
+    COMMAND_LOG("%s\n", statusMessage.c_str());
+    saveState(key.c_str(), statusMessage.c_str());
+}
+
+/**
+ * @brief Marks a control value as not yet written to the peripheral (BLE task only).
+ */
+void storePendingCommand(int device, int field) {
+    pendingFields[device] |= (uint8_t)(1 << field);
+    COMMAND_LOG("Command stored for later execution\n");
+}
+
+/**
+ * @brief A pipelined write waiting for the confirming read.
+ */
+struct UnconfirmedWrite {
+    uint32_t enqueuedUs;  ///< commandClockUs() when the command was queued
+    LinkProfile profile;  ///< Link profile in effect when the command was written
+    int8_t field;         ///< ControlField written
+};
+
+/**
+ * @brief Pipelined writes to one device since its last confirming read (BLE task only).
+ */
+struct WriteBatch {
+    uint8_t fields;     ///< Bit per ControlField written
+    int8_t lastField;   ///< Field written last, read back to confirm the batch
+    uint8_t count;
+    UnconfirmedWrite writes[MAX_UNCONFIRMED_WRITES];
+};
+
+WriteBatch writeBatches[MAX_CLIENTS];
+
+/**
+ * @brief Confirms the pipelined writes to a device with one read (BLE task only).
+ *
+ * The peripheral's ATT server handles PDUs in order, so the read response
+ * arrives after every earlier write command was processed; the value read
+ * back must be the last one written. If it is not (or the read fails), the
+ * batch is re-sent with acknowledged writes, and values that still cannot be
+ * written are kept pending for reconciliation. Only confirmed writes count as
+ * pipelined latency; re-sent ones count as acked.
+ *
+ * @param device The device index.
+ */
+void confirmWrites(int device) {
+    WriteBatch& batch = writeBatches[device];
+    if (!batch.fields) return;
+    char value[CONTROL_VALUE_SIZE];
+    const bool confirmed = controlLink->read(device, batch.lastField, value, sizeof(value)) &&
+                           strcmp(value, deviceState[device][batch.lastField]) == 0;
+    uint8_t resentFields = 0;
+    if (!confirmed)
+    {
+        pipelineFallbacks.fetch_add(1, std::memory_order_relaxed);
+        for (int field = 0; field < CONTROL_COUNT; ++field) {
+            if (!(batch.fields & (1 << field))) continue;
+            WriteMode mode = WRITE_ACKED;
+            if (controlLink->write(device, field, deviceState[device][field], mode))  resentFields |= (uint8_t)(1 << field);
+            else                                                                    storePendingCommand(device, field);
+        }
+    }
+    const uint32_t now = commandClockUs();
+    for (int i = 0; i < batch.count; ++i) {
+        const UnconfirmedWrite& write = batch.writes[i];
+        if (!confirmed && !(resentFields & (1 << write.field))) continue;  // Not written: no latency to report
+        commandWriteLatency[confirmed ? WRITE_PIPELINED : WRITE_ACKED].record(now - write.enqueuedUs);
+        writeLatency[write.profile].record(now - write.enqueuedUs);
+    }
+    batch.fields = 0;
+    batch.count = 0;
+}
+
+/**
+ * @brief Adds a pipelined write to the device's batch (BLE task only).
+ */
+void addUnconfirmedWrite(int device, int field, uint32_t enqueuedUs, LinkProfile profile) {
+    WriteBatch& batch = writeBatches[device];
+    if (batch.count == MAX_UNCONFIRMED_WRITES) confirmWrites(device);
+    batch.fields |= (uint8_t)(1 << field);
+    batch.lastField = (int8_t)field;
+    batch.writes[batch.count].enqueuedUs = enqueuedUs;
+    batch.writes[batch.count].profile = profile;
+    batch.writes[batch.count].field = (int8_t)field;
+    batch.count++;
+}
+
+/**
+ * @brief Confirms the pipelined writes of every device; called once the command queue is drained (BLE task only).
+ */
+void confirmPipelinedWrites() {
+    for (int i = 0; i < MAX_CLIENTS; ++i) confirmWrites(i);
+}
+
+/**
+ * @brief Executes a queued command: publishes the new status, writes it to the
+ *        peripheral (or marks it pending) and saves it (BLE task only).
+ *
+ * Works on fixed-size stack buffers only and does not touch the heap: the NVS
+ * store keeps its handle open and confirming reads go into a stack buffer. The
+ * host soak (test/test_command_path) checks this with every write mode, with
+ * connected and disconnected devices.
+ *
+ * @param command The command to execute.
+ */
+void executeCommand(const GatewayCommand& command) {
+    const int device = command.device;
+    if (command.kind == CMD_WAKE)
+    {
+        for (int i = 0; i < MAX_CLIENTS; ++i) controlLink->markActivity(i);
+        return;
+    }
+    if (device < 0 || device >= MAX_CLIENTS) return;
+
+    const char* value = command.value;
+    int field;
+    switch (command.kind) {
+        case CMD_TOGGLE:
+            field = CONTROL_STATE;
+            value = strcmp(deviceState[device][CONTROL_STATE], "on") == 0 ? "off" : "on";
+            break;
+        case CMD_SET_STATE:
+            field = CONTROL_STATE;
+            value = strcmp(value, "on") == 0 ? "on" : "off";
+            break;
+        case CMD_POWER: field = CONTROL_POWER; break;
+        case CMD_MODE:  field = CONTROL_MODE;  break;
+        case CMD_TEMP:  field = CONTROL_TEMP;  break;
+        default:
+            return;
+    }
+    if (!deviceHasField(device, field)) return;
+    copyString(deviceState[device][field], value, CONTROL_VALUE_SIZE);
+    value = deviceState[device][field];
+    stateChanged = true;
+
+    FixedString<40> statusMessage;
+    FixedString<16> key;
+    buildStatus(device, field, value, statusMessage, key);
+    // Send update to the WebSocket clients (and, through the network task, to the other gateways)
+    if (onControlStatus) onControlStatus(device, field, statusMessage.c_str(), &command);
+    COMMAND_LOG("%s\n", statusMessage.c_str());
+    // Send to BLE Peripheral. Every write sets an absolute value (a toggle was resolved above),
+    // so pipelined writes can safely be re-sent if the confirming read disagrees.
+    const LinkProfile profile = controlLink->markActivity(device);
+    WriteMode mode = (WriteMode)writeMode.load(std::memory_order_relaxed);
+    if (controlLink->write(device, field, value, mode))
+    {
+        pendingFields[device] &= (uint8_t)~(1 << field);
+        if (mode == WRITE_PIPELINED)
+            addUnconfirmedWrite(device, field, command.enqueuedUs, profile);
+        else
+        {
+            const uint32_t elapsedUs = commandClockUs() - command.enqueuedUs;
+            writeLatency[profile].record(elapsedUs);
+            commandWriteLatency[WRITE_ACKED].record(elapsedUs);
+        }
+    }
+    else
+        storePendingCommand(device, field);
+    // Save last value to NVS
+    saveState(key.c_str(), statusMessage.c_str());
+
+    commandLatency.record(commandClockUs() - command.enqueuedUs);
+    commandsExecuted.fetch_add(1, std::memory_order_relaxed);
+}
+
+#endif // COMMAND_PATH_H
@@ -0,0 +1,94 @@
+#ifndef CONTROLS_H
+#define CONTROLS_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Devices and control values shared by the BLE client and the command path.
+// Kept free of Arduino and NimBLE headers so the command path also builds on the host.
+
+#define MAX_CLIENTS 4  // Adjust based on your max number of BLE clients
+
+// BLE MAC addresses for specific devices
+static const char* AC_MAC = "64:e8:33:8c:04:a6"; // Air Conditioner
+static const char* PARENTS_ROOM_DUMPER_MAC = "9c:9e:6e:c1:09:e2"; // Parents room damper
+static const char* WORKING_ROOM_DUMPER_MAC = "9c:9e:6e:c1:0c:5e"; // Working room damper
+static const char* TEST1_MAC = "64:e8:33:8a:7c:be"; // Safe room damper
+static const char* TEST2_MAC = "DC:06:75:E9:6F:92"; // Redundant Controller
+static const char* SAFE_ROOM_DUMPER_MAC = "DC:06:75:E9:3C:02"; // Tests Controller
+
+
+// Map of damper indices to their corresponding MAC addresses
+static const std::unordered_map<int, std::string> damperMacMap = {
+    {0, AC_MAC},
+    {1, PARENTS_ROOM_DUMPER_MAC},
+    {2, WORKING_ROOM_DUMPER_MAC},
+    {3, SAFE_ROOM_DUMPER_MAC},
+    {4, TEST1_MAC},
+    {5, TEST2_MAC}
+};
+
+/**
+ * @brief Get the device index (key of damperMacMap) for a MAC address.
+ * @param mac The MAC address to look up.
+ * @return The device index, or -1 if the MAC is not known.
+ */
+inline int deviceIndexOfMac(const std::string& mac) {
+    for (const auto& pair : damperMacMap)
+        if (pair.second == mac) return pair.first;
+    return -1;
+}
+
+/**
+ * @brief Get the name of the device with a MAC address.
+ * @return The device name, or "None" if the MAC is not one of the controlled devices.
+ */
+inline std::string deviceNameOfMac(const std::string& mac) {
+    switch (deviceIndexOfMac(mac)) {
+        case 0: return "AC";
+        case 1: return "PARENTS_ROOM_DUMPER";   // Parents room damper
+        case 2: return "WORKING_ROOM_DUMPER";   // Working room damper
+        case 3: return "SAFE_ROOM_DUMPER_MAC";  // Safe room damper
+        default: return "None";
+    }
+}
+
+/**
+ * @brief Check whether an advertisement is from one of the targets (by MAC address or name).
+ */
+inline bool isTargetIdentifier(const std::vector<std::string>& targets, const std::string& address, const std::string& name) {
+    for (const auto& target : targets)
+        if (target == address || target == name) return true;
+    return false;
+}
+
+/**
+ * @brief Control characteristics of a peripheral.
+ */
+enum ControlField : uint8_t {
+    CONTROL_STATE = 0,  ///< STATE_UUID: "on" / "off"
+    CONTROL_POWER,      ///< VENT_SPEED_UUID
+    CONTROL_MODE,       ///< MODE_UUID (AC only)
+    CONTROL_TEMP,       ///< TEMP_UUID (AC only)
+    CONTROL_COUNT
+};
+
+static const char* const fieldNames[CONTROL_COUNT] = {"state", "power", "mode", "temp"};
+
+#define CONTROL_VALUE_SIZE 12
+
+/**
+ * @brief Connection parameter profile of a link.
+ */
+enum LinkProfile : uint8_t {
+    LINK_DEFAULT = 0,   ///< Whatever was negotiated at connect time
+    LINK_LOW_LATENCY,   ///< Short interval, no slave latency
+    LINK_POWER_SAVE,    ///< Long interval, slave latency
+    LINK_PROFILE_COUNT
+};
+
+static const char* const linkProfileNames[LINK_PROFILE_COUNT] = {"default", "low_latency", "power_save"};
+
+#endif // CONTROLS_H
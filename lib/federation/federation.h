@@ -0,0 +1,588 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "latency_stats.h"
+
+// Several gateways on the same LAN share the devices between them. Every gateway
+// broadcasts a heartbeat with the RSSI at which it hears each device and which
+// devices it is connected to; from those every gateway computes the same owner
+// per device. Commands for a device owned by a peer are forwarded to it, and
+// every gateway broadcasts its status changes as deltas so each UI shows the
+// whole house.
+//
+// A forwarded command is acknowledged by the owner as soon as it is queued
+// (or by its delta, whichever arrives first) and re-sent until then. The owner
+// executes a re-sent command only once. After FEDERATION_FORWARD_ATTEMPTS sends
+// without an answer the command is handed back to the application, which
+// executes it locally (or keeps it pending until the device is reachable).
+//
+// The protocol only talks to a FederationTransport and a FederationClock, so it
+// also runs on the host against an in-memory network (test/test_federation).
+// The device uses UDP and the system clock from federation_udp.h.
+
+#define FEDERATION_PORT 4210
+#define FEDERATION_MAGIC 0xAC5F
+#define FEDERATION_VERSION 2
+#define FEDERATION_MAX_DEVICES 8
+#define FEDERATION_MAX_PEERS 4
+#define FEDERATION_HEARTBEAT_MS 1000
+#define FEDERATION_PEER_TIMEOUT_MS 3500    // A peer is gone after ~3 missed heartbeats
+#define FEDERATION_RSSI_MAX_AGE_MS 10000   // Older advertisement RSSI is not a claim
+#define FEDERATION_HANDOVER_MARGIN_DB 8    // Hysteresis before a connected device moves
+#define FEDERATION_ACK_TIMEOUT_MS 200     // Re-send a forwarded command not acknowledged within this time
+#define FEDERATION_FORWARD_ATTEMPTS 3      // Sends of a forwarded command before it is handed back
+#define FEDERATION_NO_OWNER 0xFF
+#define FEDERATION_NO_RSSI INT8_MIN
+#define FEDERATION_BROADCAST 0xFFFFFFFFu   // Transport address of every gateway
+
+enum FederationMessageType : uint8_t {
+    FED_HEARTBEAT = 1,  ///< Broadcast: link quality and connections of the sender
+    FED_COMMAND,        ///< Unicast: command forwarded to the device owner
+    FED_DELTA,          ///< Broadcast: status or voltage change published by the sender
+    FED_ACK             ///< Unicast: forwarded command queued by the device owner
+};
+
+struct __attribute__((packed)) FederationHeader {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t type;       ///< FederationMessageType
+    uint8_t gatewayId;  ///< Sender
+    uint8_t reserved;
+    uint16_t seq;       ///< Per-sender sequence number
+};
+
+struct __attribute__((packed)) FederationHeartbeat {
+    FederationHeader header;
+    uint8_t connectedMask;                  ///< Bit per device the sender is connected to
+    int8_t rssi[FEDERATION_MAX_DEVICES];    ///< Link or advertisement RSSI, FEDERATION_NO_RSSI if not heard
+};
+
+struct __attribute__((packed)) FederationCommand {
+    FederationHeader header;
+    uint8_t kind;       ///< Application command kind
+    int8_t device;
+    char value[12];
+};
+
+struct __attribute__((packed)) FederationDelta {
+    FederationHeader header;
+    uint8_t eventKind;       ///< Application event kind
+    int8_t device;
+    int8_t field;            ///< Application control field, -1 if not applicable
+    uint8_t replyToGateway;  ///< Gateway whose forwarded command caused this delta, FEDERATION_NO_OWNER if none
+    uint16_t replyToSeq;     ///< Sequence number of that forwarded command
+    uint16_t millivolts;
+    char text[40];
+};
+
+struct __attribute__((packed)) FederationAck {
+    FederationHeader header;
+    uint16_t ackSeq;         ///< Sequence number of the acknowledged FED_COMMAND
+};
+
+/**
+ * @class FederationTransport
+ * @brief Datagrams between gateways: UDP on the device, in memory in the tests (network task only).
+ *
+ * Addresses are IPv4 addresses as 32-bit values; FEDERATION_BROADCAST reaches every gateway.
+ */
+class FederationTransport {
+public:
+    virtual ~FederationTransport() {}
+
+    /**
+     * @brief Start listening on a port.
+     * @return False if the socket could not be opened.
+     */
+    virtual bool open(uint16_t port) = 0;
+
+    /**
+     * @brief Send one datagram.
+     * @return False if it could not be sent.
+     */
+    virtual bool send(uint32_t address, const void* packet, size_t size) = 0;
+
+    /**
+     * @brief Take the next received datagram, truncated to the buffer.
+     * @param from Receives the sender's address.
+     * @return The number of bytes copied to the buffer, 0 if nothing is waiting.
+     */
+    virtual size_t receive(void* buffer, size_t size, uint32_t& from) = 0;
+};
+
+/**
+ * @class FederationClock
+ * @brief Time source of the federation: the system clock on the device, a manual clock in the tests.
+ */
+class FederationClock {
+public:
+    virtual ~FederationClock() {}
+    virtual uint32_t nowMs() = 0;  ///< Milliseconds, wrapping like millis()
+    virtual int64_t nowUs() = 0;   ///< Microseconds for the latency stats; called from both tasks
+};
+
+/**
+ * @class GatewayFederation
+ * @brief Device ownership, command forwarding and state sync between gateways.
+ *
+ * begin(), poll(), forwardCommand() and broadcastDelta() must be called from the network task.
+ * observeLocal(), onLocalConnected(), ownerOf() and mayConnect() may be called from the BLE task,
+ * also before begin(): the state they share is initialised by the constructor.
+ */
+class GatewayFederation {
+public:
+    /// A peer forwarded a command to us; return false if it could not be queued (the peer re-sends it)
+    bool (*onRemoteCommand)(const FederationCommand& command) = nullptr;
+    void (*onRemoteDelta)(const FederationDelta& delta) = nullptr;        ///< A peer published a change
+    /// The owner never acknowledged a forwarded command; it must now be executed locally
+    void (*onForwardFailed)(const FederationCommand& command) = nullptr;
+
+    GatewayFederation(FederationTransport& transport, FederationClock& clock) : transport(transport), clock(clock) {
+        for (int d = 0; d < FEDERATION_MAX_DEVICES; ++d) {
+            localRssi[d].store(FEDERATION_NO_RSSI, std::memory_order_relaxed);
+            localSeenMs[d].store(0, std::memory_order_relaxed);
+            owners[d].store(FEDERATION_NO_OWNER, std::memory_order_relaxed);
+            ownershipGainedUs[d].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Open the transport; may be called again after a failure.
+     * @param id This gateway's id, unique on the LAN (FEDERATION_NO_OWNER is reserved and mapped to 0xFE).
+     * @return True once the gateway is listening.
+     */
+    bool begin(uint8_t id) {
+        if (isStarted()) return true;
+        gatewayId = id == FEDERATION_NO_OWNER ? FEDERATION_NO_OWNER - 1 : id;
+        const bool opened = transport.open(FEDERATION_PORT);
+        started.store(opened, std::memory_order_release);
+        return opened;
+    }
+
+    bool isStarted() const { return started.load(std::memory_order_acquire); }
+    uint8_t id() const { return gatewayId; }
+
+    /**
+     * @brief Record how well this gateway hears a device (BLE task).
+     * @param device The device index.
+     * @param rssi Advertisement or link RSSI in dBm.
+     * @param connected Whether this gateway is connected to the device.
+     */
+    void observeLocal(int device, int rssi, bool connected) {
+        if (device < 0 || device >= FEDERATION_MAX_DEVICES) return;
+        localRssi[device] = (int8_t)(rssi < -127 ? -127 : rssi > 0 ? 0 : rssi);
+        localSeenMs[device] = clock.nowMs();
+        const uint8_t bit = (uint8_t)(1 << device);
+        if (connected) localConnected.fetch_or(bit);
+        else           localConnected.fetch_and((uint8_t)~bit);
+    }
+
+    /**
+     * @brief Record that this gateway connected to a device (BLE task); completes a handover.
+     */
+    void onLocalConnected(int device) {
+        if (device < 0 || device >= FEDERATION_MAX_DEVICES) return;
+        localConnected.fetch_or((uint8_t)(1 << device));
+        const int64_t gained = ownershipGainedUs[device].exchange(0);
+        if (gained) handoverLatency.record((uint32_t)(clock.nowUs() - gained));
+    }
+
+    /**
+     * @brief Record that this gateway lost a device (BLE task).
+     */
+    void onLocalDisconnected(int device) {
+        if (device < 0 || device >= FEDERATION_MAX_DEVICES) return;
+        localConnected.fetch_and((uint8_t)~(1 << device));
+    }
+
+    /**
+     * @brief Owner of a device: a gateway id, or FEDERATION_NO_OWNER if no gateway hears it.
+     */
+    uint8_t ownerOf(int device) const {
+        if (device < 0 || device >= FEDERATION_MAX_DEVICES) return FEDERATION_NO_OWNER;
+        return owners[device].load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Whether this gateway may hold a connection to a device.
+     */
+    bool mayConnect(int device) const {
+        const uint8_t owner = ownerOf(device);
+        return !isStarted() || owner == FEDERATION_NO_OWNER || owner == gatewayId;
+    }
+
+    /**
+     * @brief Receive packets, send the heartbeat and recompute ownership (network task).
+     */
+    void poll() {
+        if (!isStarted()) return;
+        uint8_t buffer[sizeof(FederationDelta)];
+        uint32_t from;
+        size_t length;
+        while ((length = transport.receive(buffer, sizeof(buffer), from)) > 0)
+            handlePacket(buffer, length, from);
+        const uint32_t now = clock.nowMs();
+        retryForwards(now);
+        if (now - lastHeartbeatMs >= FEDERATION_HEARTBEAT_MS) {
+            sendHeartbeat();
+            lastHeartbeatMs = now;
+            updateOwnership();
+        }
+    }
+
+    /**
+     * @brief Forward a command to the owner of its device if that is a peer (network task).
+     *
+     * The command is re-sent until the owner acknowledges it; see onForwardFailed.
+     *
+     * @return True if the command was forwarded and must not be executed locally.
+     */
+    bool forwardCommand(uint8_t kind, int device, const char* value) {
+        const uint8_t owner = ownerOf(device);
+        if (!isStarted() || owner == FEDERATION_NO_OWNER || owner == gatewayId) return false;
+        const Peer* peer = findPeer(owner);
+        if (!peer) return false;
+        ForwardedCommand* forwarded = nullptr;
+        for (ForwardedCommand& slot : forwards)
+            if (!slot.sentUs) {
+                forwarded = &slot;
+                break;
+            }
+        if (!forwarded) return false;  // Too many commands in flight: execute locally
+        FederationCommand& command = forwarded->command;
+        fillHeader(command.header, FED_COMMAND);
+        command.kind = kind;
+        command.device = (int8_t)device;
+        copyText(command.value, value, sizeof(command.value));
+        if (!transport.send(peer->address, &command, sizeof(command))) return false;
+        forwarded->address = peer->address;
+        forwarded->sentMs = clock.nowMs();
+        forwarded->sentUs = clock.nowUs();
+        forwarded->attempts = 1;
+        forwarded->acked = false;
+        commandsForwarded++;
+        return true;
+    }
+
+    /**
+     * @brief Broadcast a local status or voltage change to the peers (network task).
+     */
+    void broadcastDelta(uint8_t eventKind, int device, int field, const char* text, uint16_t millivolts,
+                        uint8_t replyToGateway, uint16_t replyToSeq) {
+        if (!isStarted() || !hasPeers()) return;
+        FederationDelta delta;
+        fillHeader(delta.header, FED_DELTA);
+        delta.eventKind = eventKind;
+        delta.device = (int8_t)device;
+        delta.field = (int8_t)field;
+        delta.replyToGateway = replyToGateway;
+        delta.replyToSeq = replyToSeq;
+        delta.millivolts = millivolts;
+        copyText(delta.text, text, sizeof(delta.text));
+        transport.send(FEDERATION_BROADCAST, &delta, sizeof(delta));
+    }
+
+#ifdef ARDUINO
+    /**
+     * @brief Print peers, ownership and forwarding/handover latency.
+     */
+    void printStats() const {
+        if (!isStarted()) return;
+        const uint32_t now = clock.nowMs();
+        for (const Peer& peer : peers)
+            if (peer.id != FEDERATION_NO_OWNER && now - peer.lastHeardMs < FEDERATION_PEER_TIMEOUT_MS)
+                Serial.printf("[fed] peer %u  %s  connected 0x%02x\n", peer.id, IPAddress(peer.address).toString().c_str(),
+                              peer.connectedMask);
+        Serial.printf("[fed] gateway %u owners:", gatewayId);
+        for (int d = 0; d < FEDERATION_MAX_DEVICES; ++d) {
+            const uint8_t owner = ownerOf(d);
+            if (owner == FEDERATION_NO_OWNER) Serial.print(" -");
+            else Serial.printf(" %u", owner);
+        }
+        Serial.printf("\n[fed] forwarded %lu  re-sent %lu  failed %lu  received %lu  duplicates %lu  bad packets %lu\n",
+                      (unsigned long)commandsForwarded, (unsigned long)forwardRetries, (unsigned long)forwardFailures,
+                      (unsigned long)commandsReceived, (unsigned long)duplicateCommands, (unsigned long)badPackets);
+        forwardLatency.print("forward");
+        handoverLatency.print("handover");
+    }
+#endif
+
+    uint32_t forwardedCount() const { return commandsForwarded; }  ///< Commands forwarded to peers
+    uint32_t retryCount() const { return forwardRetries; }         ///< Forwarded commands re-sent
+    uint32_t failedCount() const { return forwardFailures; }       ///< Forwarded commands handed back unacknowledged
+    uint32_t receivedCount() const { return commandsReceived; }    ///< Commands received from peers (once each)
+
+    LatencyStats forwardLatency;   ///< Forwarded command until the owner's delta came back
+    LatencyStats handoverLatency;  ///< Ownership gained until this gateway connected the device
+
+private:
+    struct Peer {
+        uint8_t id = FEDERATION_NO_OWNER;
+        uint32_t address = 0;
+        uint32_t lastHeardMs = 0;
+        uint8_t connectedMask = 0;
+        int8_t rssi[FEDERATION_MAX_DEVICES];
+    };
+
+    /**
+     * @brief A forwarded command until its delta comes back (or it was acknowledged long enough ago).
+     */
+    struct ForwardedCommand {
+        FederationCommand command;  ///< As sent, for the re-sends
+        uint32_t address = 0;       ///< Owner it was sent to
+        uint32_t sentMs = 0;        ///< Last send
+        int64_t sentUs = 0;         ///< First send, for the latency; 0 if the slot is free
+        uint8_t attempts = 0;
+        bool acked = false;
+    };
+    static const size_t FORWARD_SLOTS = 16;
+
+    /**
+     * @brief A command received from a peer, to recognize its re-sends.
+     */
+    struct ReceivedCommand {
+        uint8_t gatewayId = FEDERATION_NO_OWNER;
+        uint16_t seq = 0;
+    };
+    static const size_t RECEIVED_SLOTS = 16;
+
+    FederationTransport& transport;
+    FederationClock& clock;
+    std::atomic<bool> started{false};
+    uint8_t gatewayId = 0;  // Written by begin() before `started` is set
+    uint16_t nextSeq = 0;
+    uint32_t lastHeartbeatMs = 0;
+    Peer peers[FEDERATION_MAX_PEERS];
+    ForwardedCommand forwards[FORWARD_SLOTS];
+    ReceivedCommand received[RECEIVED_SLOTS];  ///< Ring of the last commands received
+    size_t nextReceived = 0;
+    uint32_t commandsForwarded = 0;
+    uint32_t forwardRetries = 0;
+    uint32_t forwardFailures = 0;
+    uint32_t commandsReceived = 0;
+    uint32_t duplicateCommands = 0;
+    uint32_t badPackets = 0;
+
+    // Written by the BLE task, read by the network task
+    std::atomic<int8_t> localRssi[FEDERATION_MAX_DEVICES];
+    std::atomic<uint32_t> localSeenMs[FEDERATION_MAX_DEVICES];
+    std::atomic<uint8_t> localConnected{0};
+    // Written by the network task, read by the BLE task
+    std::atomic<uint8_t> owners[FEDERATION_MAX_DEVICES];
+    std::atomic<int64_t> ownershipGainedUs[FEDERATION_MAX_DEVICES];
+
+    static void copyText(char* destination, const char* source, size_t size) {
+        strncpy(destination, source, size - 1);
+        destination[size - 1] = '\0';
+    }
+
+    void fillHeader(FederationHeader& header, FederationMessageType type) {
+        header.magic = FEDERATION_MAGIC;
+        header.version = FEDERATION_VERSION;
+        header.type = type;
+        header.gatewayId = gatewayId;
+        header.reserved = 0;
+        header.seq = nextSeq++;
+    }
+
+    bool hasPeers() const {
+        const uint32_t now = clock.nowMs();
+        for (const Peer& peer : peers)
+            if (peer.id != FEDERATION_NO_OWNER && now - peer.lastHeardMs < FEDERATION_PEER_TIMEOUT_MS) return true;
+        return false;
+    }
+
+    const Peer* findPeer(uint8_t id) const {
+        const uint32_t now = clock.nowMs();
+        for (const Peer& peer : peers)
+            if (peer.id == id && now - peer.lastHeardMs < FEDERATION_PEER_TIMEOUT_MS) return &peer;
+        return nullptr;
+    }
+
+    Peer* peerSlot(uint8_t id) {
+        const uint32_t now = clock.nowMs();
+        Peer* freeSlot = nullptr;
+        for (Peer& peer : peers) {
+            if (peer.id == id) return &peer;
+            if (!freeSlot && (peer.id == FEDERATION_NO_OWNER || now - peer.lastHeardMs >= FEDERATION_PEER_TIMEOUT_MS))
+                freeSlot = &peer;
+        }
+        return freeSlot;
+    }
+
+    /**
+     * @brief RSSI at which this gateway hears a device: FEDERATION_NO_RSSI unless connected or heard recently.
+     */
+    int8_t localClaim(int device, uint8_t connectedMask, uint32_t now) const {
+        if (connectedMask & (1 << device)) return localRssi[device].load();
+        if (now - localSeenMs[device].load() >= FEDERATION_RSSI_MAX_AGE_MS) return FEDERATION_NO_RSSI;
+        return localRssi[device].load();  // Still FEDERATION_NO_RSSI if not heard since boot
+    }
+
+    /**
+     * @brief Re-send the forwarded commands not acknowledged in time; hand back the ones out of attempts.
+     */
+    void retryForwards(uint32_t now) {
+        for (ForwardedCommand& forwarded : forwards) {
+            if (!forwarded.sentUs) continue;
+            if (forwarded.acked) {
+                // No delta (e.g. a command without a status change): stop waiting for the latency
+                if (now - forwarded.sentMs >= FEDERATION_PEER_TIMEOUT_MS) forwarded.sentUs = 0;
+                continue;
+            }
+            if (now - forwarded.sentMs < FEDERATION_ACK_TIMEOUT_MS) continue;
+            if (forwarded.attempts < FEDERATION_FORWARD_ATTEMPTS &&
+                transport.send(forwarded.address, &forwarded.command, sizeof(forwarded.command))) {
+                forwarded.attempts++;
+                forwarded.sentMs = now;
+                forwardRetries++;
+                continue;
+            }
+            forwarded.sentUs = 0;
+            forwardFailures++;
+            if (onForwardFailed) onForwardFailed(forwarded.command);
+        }
+    }
+
+    /**
+     * @brief The forwarded command with this sequence number, or nullptr.
+     */
+    ForwardedCommand* findForward(uint16_t seq) {
+        for (ForwardedCommand& forwarded : forwards)
+            if (forwarded.sentUs && forwarded.command.header.seq == seq) return &forwarded;
+        return nullptr;
+    }
+
+    /**
+     * @brief Queue a command from a peer once, and acknowledge it (again, for a re-send).
+     */
+    void receiveCommand(const FederationCommand& command, uint32_t from) {
+        bool duplicate = false;
+        for (const ReceivedCommand& entry : received)
+            if (entry.gatewayId == command.header.gatewayId && entry.seq == command.header.seq) duplicate = true;
+        if (duplicate)
+            duplicateCommands++;
+        else {
+            if (onRemoteCommand && !onRemoteCommand(command)) return;  // Not queued: no ack, the peer re-sends
+            received[nextReceived].gatewayId = command.header.gatewayId;
+            received[nextReceived].seq = command.header.seq;
+            nextReceived = (nextReceived + 1) % RECEIVED_SLOTS;
+            commandsReceived++;
+        }
+        FederationAck ack;
+        fillHeader(ack.header, FED_ACK);
+        ack.ackSeq = command.header.seq;
+        transport.send(from, &ack, sizeof(ack));
+    }
+
+    void sendHeartbeat() {
+        FederationHeartbeat heartbeat;
+        fillHeader(heartbeat.header, FED_HEARTBEAT);
+        heartbeat.connectedMask = localConnected.load();
+        const uint32_t now = clock.nowMs();
+        for (int d = 0; d < FEDERATION_MAX_DEVICES; ++d)
+            heartbeat.rssi[d] = localClaim(d, heartbeat.connectedMask, now);
+        transport.send(FEDERATION_BROADCAST, &heartbeat, sizeof(heartbeat));
+    }
+
+    void handlePacket(const uint8_t* buffer, size_t length, uint32_t from) {
+        if (length < sizeof(FederationHeader)) {
+            badPackets++;
+            return;
+        }
+        FederationHeader header;
+        memcpy(&header, buffer, sizeof(header));
+        if (header.magic != FEDERATION_MAGIC || header.version != FEDERATION_VERSION) {
+            badPackets++;
+            return;
+        }
+        if (header.gatewayId == gatewayId) return;  // Our own broadcast
+
+        if (header.type == FED_HEARTBEAT && length >= sizeof(FederationHeartbeat)) {
+            FederationHeartbeat heartbeat;
+            memcpy(&heartbeat, buffer, sizeof(heartbeat));
+            Peer* peer = peerSlot(header.gatewayId);
+            if (!peer) return;
+            peer->id = header.gatewayId;
+            peer->address = from;
+            peer->lastHeardMs = clock.nowMs();
+            peer->connectedMask = heartbeat.connectedMask;
+            memcpy(peer->rssi, heartbeat.rssi, sizeof(peer->rssi));
+        }
+        else if (header.type == FED_COMMAND && length >= sizeof(FederationCommand)) {
+            FederationCommand command;
+            memcpy(&command, buffer, sizeof(command));
+            command.value[sizeof(command.value) - 1] = '\0';
+            receiveCommand(command, from);
+        }
+        else if (header.type == FED_ACK && length >= sizeof(FederationAck)) {
+            FederationAck ack;
+            memcpy(&ack, buffer, sizeof(ack));
+            ForwardedCommand* forwarded = findForward(ack.ackSeq);
+            if (forwarded && forwarded->address == from) forwarded->acked = true;
+        }
+        else if (header.type == FED_DELTA && length >= sizeof(FederationDelta)) {
+            FederationDelta delta;
+            memcpy(&delta, buffer, sizeof(delta));
+            delta.text[sizeof(delta.text) - 1] = '\0';
+            if (delta.replyToGateway == gatewayId) {
+                // The delta also acknowledges the command, if the ack was lost
+                ForwardedCommand* forwarded = findForward(delta.replyToSeq);
+                if (forwarded) {
+                    forwardLatency.record((uint32_t)(clock.nowUs() - forwarded->sentUs));
+                    forwarded->sentUs = 0;
+                }
+            }
+            if (onRemoteDelta) onRemoteDelta(delta);
+        }
+        else badPackets++;
+    }
+
+    /**
+     * @brief Recompute the owner of every device from the local view and the peers' heartbeats.
+     *
+     * A connected device stays with its gateway unless another one hears it at least
+     * FEDERATION_HANDOVER_MARGIN_DB better; otherwise the best RSSI wins, lowest id on ties.
+     * Every gateway applies the same rule to the same data, so they converge on the same owner.
+     */
+    void updateOwnership() {
+        const uint32_t now = clock.nowMs();
+        const uint8_t connectedMask = localConnected.load();
+        for (int d = 0; d < FEDERATION_MAX_DEVICES; ++d) {
+            const uint8_t bit = (uint8_t)(1 << d);
+            const int8_t localRssiNow = localClaim(d, connectedMask, now);
+            uint8_t holder = (connectedMask & bit) ? gatewayId : FEDERATION_NO_OWNER;
+            int holderRssi = localRssiNow;
+            uint8_t best = localRssiNow != FEDERATION_NO_RSSI ? gatewayId : FEDERATION_NO_OWNER;
+            int bestRssi = localRssiNow;
+            for (const Peer& peer : peers) {
+                if (peer.id == FEDERATION_NO_OWNER || now - peer.lastHeardMs >= FEDERATION_PEER_TIMEOUT_MS) continue;
+                const int rssi = peer.rssi[d];
+                if ((peer.connectedMask & bit) && (holder == FEDERATION_NO_OWNER || peer.id < holder)) {
+                    holder = peer.id;
+                    holderRssi = rssi;
+                }
+                if (rssi == FEDERATION_NO_RSSI) continue;
+                if (best == FEDERATION_NO_OWNER || rssi > bestRssi || (rssi == bestRssi && peer.id < best)) {
+                    best = peer.id;
+                    bestRssi = rssi;
+                }
+            }
+            uint8_t owner = best;
+            if (holder != FEDERATION_NO_OWNER && (best == FEDERATION_NO_OWNER || bestRssi < holderRssi + FEDERATION_HANDOVER_MARGIN_DB))
+                owner = holder;
+
+            const uint8_t previous = owners[d].exchange(owner);
+            if (owner == gatewayId && previous != gatewayId && !(connectedMask & bit))
+                ownershipGainedUs[d] = clock.nowUs();
+            else if (owner != gatewayId)
+                ownershipGainedUs[d] = 0;
+        }
+    }
+};
+
+#endif // FEDERATION_H
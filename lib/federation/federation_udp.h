@@ -0,0 +1,50 @@
+#ifndef FEDERATION_UDP_H
+#define FEDERATION_UDP_H
+
+#include "Arduino.h"
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <esp_timer.h>
+#include "federation.h"
+
+/**
+ * @class UdpFederationTransport
+ * @brief Federation datagrams over the Wi-Fi UDP socket.
+ */
+class UdpFederationTransport : public FederationTransport {
+public:
+    bool open(uint16_t port) override {
+        this->port = port;
+        return udp.begin(port);
+    }
+
+    bool send(uint32_t address, const void* packet, size_t size) override {
+        if (!udp.beginPacket(IPAddress(address), port)) return false;
+        udp.write(static_cast<const uint8_t*>(packet), size);
+        return udp.endPacket() == 1;
+    }
+
+    size_t receive(void* buffer, size_t size, uint32_t& from) override {
+        if (udp.parsePacket() <= 0) return 0;
+        const int length = udp.read(static_cast<uint8_t*>(buffer), size);
+        from = (uint32_t)udp.remoteIP();
+        udp.flush();  // Drop the rest of an oversized datagram
+        return length > 0 ? (size_t)length : 0;
+    }
+
+private:
+    WiFiUDP udp;
+    uint16_t port = FEDERATION_PORT;
+};
+
+/**
+ * @class EspFederationClock
+ * @brief millis() and the high-resolution ESP timer.
+ */
+class EspFederationClock : public FederationClock {
+public:
+    uint32_t nowMs() override { return millis(); }
+    int64_t nowUs() override { return esp_timer_get_time(); }
+};
+
+#endif // FEDERATION_UDP_H
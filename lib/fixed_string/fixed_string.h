@@ -0,0 +1,101 @@
+#ifndef FIXED_STRING_H
+#define FIXED_STRING_H
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+
+/**
+ * @class FixedString
+ * @brief Fixed-capacity, heap-free string builder.
+ *
+ * Used on the command and notification path instead of Arduino String /
+ * std::string so that long uptimes do not fragment the heap. Instances live
+ * on the stack of the event being handled and are discarded with it.
+ * Appending past the capacity truncates (the result stays NUL-terminated).
+ *
+ * @tparam N Capacity in bytes, including the terminating NUL.
+ */
+template <size_t N>
+class FixedString {
+    static_assert(N > 1, "FixedString needs room for at least one character");
+
+public:
+    FixedString() { buffer[0] = '\0'; }
+
+    explicit FixedString(const char* text) {
+        buffer[0] = '\0';
+        append(text);
+    }
+
+    /**
+     * @brief Append a NUL-terminated string.
+     */
+    FixedString& append(const char* text) {
+        return append(text, strlen(text));
+    }
+
+    /**
+     * @brief Append up to length bytes of text.
+     */
+    FixedString& append(const char* text, size_t length) {
+        const size_t room = N - 1 - len;
+        if (length > room) length = room;
+        memcpy(buffer + len, text, length);
+        len += length;
+        buffer[len] = '\0';
+        return *this;
+    }
+
+    /**
+     * @brief Append printf-style formatted text.
+     */
+    FixedString& appendf(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+        va_list args;
+        va_start(args, format);
+        const int written = vsnprintf(buffer + len, N - len, format, args);
+        va_end(args);
+        if (written > 0) len += ((size_t)written < N - len) ? (size_t)written : N - 1 - len;
+        return *this;
+    }
+
+    void clear() {
+        len = 0;
+        buffer[0] = '\0';
+    }
+
+    const char* c_str() const { return buffer; }
+    size_t length() const { return len; }
+    bool empty() const { return len == 0; }
+    static constexpr size_t capacity() { return N - 1; }
+
+    bool operator==(const char* other) const { return strcmp(buffer, other) == 0; }
+    bool operator!=(const char* other) const { return !(*this == other); }
+
+private:
+    char buffer[N];
+    size_t len = 0;
+};
+
+/**
+ * @brief Check whether a NUL-terminated string starts with a prefix.
+ */
+inline bool startsWith(const char* text, const char* prefix) {
+    return strncmp(text, prefix, strlen(prefix)) == 0;
+}
+
+/**
+ * @brief Copy a NUL-terminated string into a buffer, truncating to fit (strlcpy, which host C libraries may lack).
+ * @return The length of source; the copy was truncated if it is size or more.
+ */
+inline size_t copyString(char* destination, const char* source, size_t size) {
+    const size_t length = strlen(source);
+    if (size == 0) return length;
+    const size_t count = length < size - 1 ? length : size - 1;
+    memcpy(destination, source, count);
+    destination[count] = '\0';
+    return length;
+}
+
+#endif // FIXED_STRING_H
@@ -10,8 +10,24 @@ char pass[] = "WIFI_PASS";
 #define BLYNK_TEMPLATE_ID "BLYNK_TEMPLATE_ID"
 #define BLYNK_TEMPLATE_NAME "AC"
 #define BLYNK_AUTH_TOKEN "BLYNK_AUTH_TOKEN"
+// Local time zone (POSIX TZ) for schedules
+#define TIMEZONE "IST-2IDT,M3.4.4/26,M10.5.0"
+#define NTP_SERVER "pool.ntp.org"
 
 #include "ble_multi_client.h"
+#include "boot_timeline.h"
+#include "spsc_queue.h"
+#include "task_stats.h"
+#include "fixed_string.h"
+#include "mem_pools.h"
+#include "latency_stats.h"
+#include "traffic_trace.h"
+#include "federation_udp.h"
+#include "timer_wheel.h"
+#include "state_store.h"
+#include "command_path.h"
+#include "schedule.h"
+#include <esp_heap_caps.h>
 #include <WiFi.h>
 #include <WiFiClient.h>
 #include <WebSocketsServer.h>
@@ -19,7 +35,8 @@ char pass[] = "WIFI_PASS";
 #include <nvs.h>
 #include <nvs_flash.h>
 #include <BlynkSimpleEsp32.h>
-#include <cstdlib>  // for atof
+#include <cstdlib>  // for atoi
+#include <time.h>
 
 // Virtual Pins
 #define VOLTAGE_START_PIN 7
@@ -32,6 +49,285 @@ Adafruit_NeoPixel pixels(NUMPIXELS, PIN, NEO_GRB + NEO_KHZ800);
 BLEClientMulti bleClient;
 // Global variable to track Wi-Fi connection status
 bool wifiConnected = false;
+// Set once the station has an IP address; services bound to the LAN wait for it
+std::atomic<bool> wifiHasIp{false};
+// Boot milestones (time-to-BLE-connected, time-to-first-command, ...)
+BootTimeline bootTimeline;
+
+// Task architecture:
+//  - network task (core 0): WebSocket/Blynk polling and command parsing
+//  - BLE task (core 1): command execution, NVS writes, BLE connections; sole owner of bleClient.clients
+// They only talk through the two lock-free queues below.
+
+/**
+ * @brief Event kinds published by the BLE task to the network side.
+ */
+enum EventKind : uint8_t {
+    EVT_STATUS,   ///< Status message to broadcast as-is
+    EVT_VOLTAGE   ///< Voltage reading of a device
+};
+
+/**
+ * @brief An event to publish to clients (BLE task -> network task).
+ */
+struct GatewayEvent {
+    EventKind kind;
+    int8_t device;        ///< Device index for EVT_VOLTAGE
+    int8_t field;         ///< ControlField of an EVT_STATUS, -1 if not applicable
+    uint8_t originGateway;  ///< Gateway whose forwarded command caused the event, FEDERATION_NO_OWNER if none
+    uint16_t originSeq;     ///< Sequence number of that forwarded command
+    uint16_t millivolts;  ///< Voltage for EVT_VOLTAGE
+    char text[40];        ///< Status message, or the voltage formatted as volts
+};
+
+/**
+ * @brief Per-device voltage aggregation, done on integers (BLE task only).
+ */
+struct VoltageStats {
+    uint32_t samples;
+    uint32_t binarySamples;  ///< Samples received in the binary format
+    uint16_t lastMv;
+    uint16_t minMv;
+    uint16_t maxMv;
+    uint64_t sumMv;
+};
+
+#define NETWORK_TASK_CORE 0  // Same core as the Wi-Fi/lwIP stack
+#define BLE_TASK_CORE 1
+#define STATS_PERIOD_MS 10000
+#define LED_REFRESH_MS 500
+#define LINK_CHECK_MS 1000
+#define SCHEDULE_CHECK_MS 1000
+#define LAN_SERVICES_RETRY_MS 1000  // Start (or retry) the services that need an IP address
+#define BLYNK_CONNECT_TIMEOUT_MS 1000  // Longest a Blynk (re)connect attempt may hold the network task
+
+TaskStats networkTaskStats("net");
+TaskStats bleTaskStats("ble");
+// Memory pools: large, latency-tolerant buffers go to PSRAM, leaving internal SRAM to NimBLE and Wi-Fi
+MemPool eventPool("events", MEM_PSRAM);   // BLE -> network event queue
+MemPool assetPool("assets", MEM_PSRAM);   // Cached static files
+MemPool tracePool("trace", MEM_PSRAM);    // Traffic recordings
+MemPool statePool("state", MEM_PSRAM);    // REST state documents
+
+// Periodic jobs, one wheel per task (a wheel is only advanced and used by its own task)
+TimerWheel<16> bleTimers;
+TimerWheel<16> networkTimers;
+
+typedef SpscQueue<GatewayEvent, 128> EventQueue;
+SpscQueue<GatewayCommand, 16> commandQueue;  // network task -> BLE task (hot, internal RAM)
+EventQueue* eventQueue = nullptr;            // BLE task -> network task (allocated from eventPool)
+
+#define TRACE_MAX_EVENTS 2048
+TrafficRecorder trafficRecorder;  // WebSocket/BLE boundary events, see "trace_*" WebSocket commands
+
+// Gateway id on the federation LAN; defaults to the last byte of the Wi-Fi MAC
+#ifndef GATEWAY_ID
+#define GATEWAY_ID ((uint8_t)(ESP.getEfuseMac() >> 40))
+#endif
+static_assert(MAX_CLIENTS <= FEDERATION_MAX_DEVICES, "Heartbeats carry one RSSI per device");
+UdpFederationTransport federationTransport;
+EspFederationClock federationClock;
+GatewayFederation federation(federationTransport, federationClock);  // Device ownership and state sync with the other gateways
+SpscQueue<GatewayEvent, 16> remoteEvents;  // Deltas received from peers, published by the network task
+SpscQueue<GatewayEvent, 16> peerDeltas;    // Deltas received from peers (network task) -> BLE task, applied to the gateway view
+
+VoltageStats voltageStats[MAX_CLIENTS];
+
+// REST state document (GET /api/state): serialized by the BLE task once per change, read by the web server
+#define STATE_DOCUMENT_SIZE 1024
+#define STATE_DOCUMENT_SLOTS 4     // The published document plus older ones still being sent
+#define STATE_VOLTAGE_STEP_MV 100  // Smaller voltage changes do not produce a new document version
+#define LONG_POLL_TIMEOUT_MS 30000
+
+/**
+ * @brief A serialized state document in one of the STATE_DOCUMENT_SLOTS slots; shared by every request that reads it.
+ *
+ * A slot is only rewritten by the BLE task once no one references it: not published and no StateDocumentRef left.
+ */
+struct StateDocument {
+    std::atomic<uint32_t> references{0};  ///< The published pointer and every StateDocumentRef
+    uint32_t boot;     ///< Random per boot, so clients notice that versions started over
+    uint32_t version;
+    FixedString<STATE_DOCUMENT_SIZE> json;
+};
+
+/**
+ * @class StateDocumentRef
+ * @brief Counted reference to a state document, released when the last copy goes away (any task).
+ */
+class StateDocumentRef {
+public:
+    StateDocumentRef() {}
+    explicit StateDocumentRef(const StateDocument* document) : document(document) {}  ///< Takes over one reference
+    StateDocumentRef(const StateDocumentRef& other) : document(other.document) {
+        if (document) const_cast<StateDocument*>(document)->references.fetch_add(1, std::memory_order_relaxed);
+    }
+    StateDocumentRef& operator=(const StateDocumentRef& other) {
+        StateDocumentRef copy(other);
+        std::swap(document, copy.document);
+        return *this;
+    }
+    ~StateDocumentRef() {
+        if (document) const_cast<StateDocument*>(document)->references.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    explicit operator bool() const { return document != nullptr; }
+    const StateDocument* operator->() const { return document; }
+    const StateDocument& operator*() const { return *document; }
+
+private:
+    const StateDocument* document = nullptr;
+};
+
+StateDocument* stateDocuments = nullptr;  // STATE_DOCUMENT_SLOTS slots in statePool
+StateDocument* stateDocument = nullptr;   // Latest document, holds one reference; swapped under stateDocumentLock
+portMUX_TYPE stateDocumentLock = portMUX_INITIALIZER_UNLOCKED;
+uint16_t documentedMv[MAX_CLIENTS];      // Voltage in the latest document (BLE task only)
+uint32_t stateDocumentStalls = 0;         // Publishes postponed because every slot was in use (BLE task only)
+
+/**
+ * @brief The latest state document, empty before the first one (any task).
+ */
+StateDocumentRef currentStateDocument() {
+    portENTER_CRITICAL(&stateDocumentLock);
+    StateDocument* document = stateDocument;
+    if (document) document->references.fetch_add(1, std::memory_order_relaxed);
+    portEXIT_CRITICAL(&stateDocumentLock);
+    return StateDocumentRef(document);
+}
+
+// Time from link up to gateway and peripheral agreeing on every control value
+LatencyStats reconcileLatency;
+
+std::atomic<uint32_t> commandsQueued{0};
+
+/**
+ * @brief Allocates the pooled buffers. Must run before the tasks are started.
+ */
+void allocateBuffers() {
+    if (!eventQueue) eventQueue = eventPool.create<EventQueue>();
+    if (!eventQueue) Serial.println("[ERROR] Unable to allocate the event queue!");
+    if (!trafficRecorder.begin(tracePool, TRACE_MAX_EVENTS)) Serial.println("[ERROR] Unable to allocate the trace buffer!");
+    if (!stateDocuments)
+    {
+        stateDocuments = static_cast<StateDocument*>(statePool.allocate(sizeof(StateDocument) * STATE_DOCUMENT_SLOTS));
+        if (stateDocuments)
+            for (int i = 0; i < STATE_DOCUMENT_SLOTS; ++i) new (&stateDocuments[i]) StateDocument();
+        else
+            Serial.println("[ERROR] Unable to allocate the state documents!");
+    }
+}
+
+/**
+ * @brief Records BLE connections and disconnections in the traffic trace and
+ *        reports them to the federation (BLE task).
+ */
+void onBleLinkChanged(int device, bool connected) {
+    trafficRecorder.record(connected ? TRACE_BLE_CONNECT : TRACE_BLE_DISCONNECT, device);
+    if (connected)  federation.onLocalConnected(device);
+    else            federation.onLocalDisconnected(device);
+    stateChanged = true;
+}
+
+/**
+ * @brief Records the links and control values at the start of a traffic recording (BLE task).
+ *
+ * Runs from the command queue, so the snapshot is taken after the commands queued
+ * before the recording and before the ones it recorded. The host replayer
+ * restores it before replaying the frames.
+ */
+void recordTraceSnapshot() {
+    for (int device = 0; device < MAX_CLIENTS; ++device) {
+        NimBLEClient* pClient = bleClient.getClientForDamper(device);
+        if (pClient && pClient->isConnected()) trafficRecorder.record(TRACE_BLE_CONNECT, device);
+        for (int field = 0; field < CONTROL_COUNT; ++field) {
+            if (!deviceHasField(device, field) || !deviceState[device][field][0]) continue;
+            FixedString<24> data;
+            data.append(fieldNames[field]).append(" ").append(deviceState[device][field]);
+            trafficRecorder.record(TRACE_STATE, device, data.c_str(), data.length());
+        }
+    }
+}
+
+/**
+ * @brief Lets the BLE task connect only to devices this gateway owns or nobody owns (BLE task).
+ */
+bool federationAllowsConnect(int device, int rssi) {
+    federation.observeLocal(device, rssi, false);
+    return federation.mayConnect(device);
+}
+
+/**
+ * @brief Queues a command for the BLE task, to be executed on this gateway (network task only).
+ *
+ * @param kind The command kind.
+ * @param device The device index (0 = AC, 1..3 = dampers).
+ * @param value The command argument.
+ * @param originGateway Gateway that forwarded the command, FEDERATION_NO_OWNER if local.
+ * @param originSeq Sequence number of the forwarded command.
+ * @param traceSeq Sequence number of the recorded frame the command was parsed from, 0 if none.
+ * @return False if the queue is full and the command was dropped.
+ */
+bool queueLocalCommand(CommandKind kind, int device, const char* value,
+                       uint8_t originGateway = FEDERATION_NO_OWNER, uint16_t originSeq = 0, uint32_t traceSeq = 0) {
+    GatewayCommand command;
+    command.kind = kind;
+    command.device = (int8_t)device;
+    strlcpy(command.value, value, sizeof(command.value));
+    command.enqueuedUs = commandClockUs();
+    command.originGateway = originGateway;
+    command.originSeq = originSeq;
+    command.traceSeq = traceSeq;
+    if (!commandQueue.push(command)) {
+        Serial.println("Command queue full, command dropped!");
+        return false;
+    }
+    commandsQueued.fetch_add(1, std::memory_order_relaxed);
+    bleTaskStats.notify();
+    return true;
+}
+
+/**
+ * @brief Queues a command for the BLE task, or forwards it to the gateway that owns the device (network task only).
+ *
+ * @param kind The command kind.
+ * @param device The device index (0 = AC, 1..3 = dampers).
+ * @param value The command argument.
+ * @param traceSeq Sequence number of the recorded frame the command was parsed from, 0 if none.
+ * @return False if the queue is full and the command was dropped.
+ */
+bool queueCommand(CommandKind kind, int device, const char* value = "", uint32_t traceSeq = 0) {
+    if (federation.forwardCommand(kind, device, value)) return true;
+    return queueLocalCommand(kind, device, value, FEDERATION_NO_OWNER, 0, traceSeq);
+}
+
+/**
+ * @brief Queues an event for the network task (BLE task only).
+ *
+ * @param kind The event kind.
+ * @param device The device index.
+ * @param text The status message or voltage text.
+ * @param millivolts The voltage for EVT_VOLTAGE.
+ * @param field The ControlField of an EVT_STATUS, or -1.
+ * @param cause The command that caused the event, if any.
+ */
+void postEvent(EventKind kind, int device, const char* text, uint16_t millivolts = 0, int field = -1,
+               const GatewayCommand* cause = nullptr) {
+    GatewayEvent event;
+    event.kind = kind;
+    event.device = (int8_t)device;
+    event.field = (int8_t)field;
+    event.originGateway = cause ? cause->originGateway : FEDERATION_NO_OWNER;
+    event.originSeq = cause ? cause->originSeq : 0;
+    event.millivolts = millivolts;
+    strlcpy(event.text, text, sizeof(event.text));
+    if (kind == EVT_STATUS) trafficRecorder.record(TRACE_STATUS, device, text, cause ? cause->traceSeq : 0);
+    if (!eventQueue || !eventQueue->push(event)) {
+        Serial.println("Event queue full, event dropped!");
+        return;
+    }
+    networkTaskStats.notify();
+}
 
 // BLE Handler
 /**
@@ -58,20 +354,30 @@ void BLE_connected(bool connected) {
  * @param CHARACTERISTIC_UUID The UUID of the BLE characteristic.
  * @param pClient The BLE client instance.
  * @param value The value to send.
+ * @param mode The write mode to use; set to the mode actually used, since pipelined
+ *             writes fall back to acked writes on characteristics without write-without-response
+ *             or that cannot be read back to confirm the batch.
+ * @return True if the value was written (acked) or handed to the link (pipelined).
  */
-bool sendDataToPeripheral(const NimBLEUUID CHARACTERISTIC_UUID, NimBLEClient* pClient, const std::string& value = "Hello") {
+bool sendDataToPeripheral(const NimBLEUUID& CHARACTERISTIC_UUID, NimBLEClient* pClient, const char* value, WriteMode& mode) {
     if (!pClient) {
         Serial.println("Client NOT connected!");
         return false;
     }
-    NimBLERemoteService* pService = pClient->getService(SERVICE_UUID);
+    static const NimBLEUUID serviceUUID(SERVICE_UUID);
+    NimBLERemoteService* pService = pClient->getService(serviceUUID);
     if (pService) {
         NimBLERemoteCharacteristic* pCharacteristic = pService->getCharacteristic(CHARACTERISTIC_UUID);
         if (pCharacteristic)
         {
-            // Replace with the data you want to send
-            pCharacteristic->writeValue(value);
-            Serial.printf("Data sent to peripheral! UUID: %s! Value: %s\n", CHARACTERISTIC_UUID.toString().c_str(), value.c_str());
+            if (mode == WRITE_PIPELINED && (!pCharacteristic->canWriteNoResponse() || !pCharacteristic->canRead()))
+                mode = WRITE_ACKED;
+            if (!pCharacteristic->writeValue(reinterpret_cast<const uint8_t*>(value), strlen(value), mode == WRITE_ACKED))
+            {
+                Serial.println("Write failed!");
+                return false;
+            }
+            Serial.printf("Data sent to peripheral (%s)! Value: %s\n", writeModeNames[mode], value);
             return true;
         }
         else
@@ -82,155 +388,530 @@ bool sendDataToPeripheral(const NimBLEUUID CHARACTERISTIC_UUID, NimBLEClient* pC
 }
 
 /**
- * @brief Handles BLE notifications and broadcasts them to WebSocket clients.
+ * @brief Sends data to a BLE peripheral with an acknowledged write.
  */
-void ble_notified(WebSocketsServer& webSocket) {
-    if (bleClient.notifty_index != -1 && bleClient.notifty_index < 4)
+bool sendDataToPeripheral(const NimBLEUUID& CHARACTERISTIC_UUID, NimBLEClient* pClient, const char* value = "Hello") {
+    WriteMode mode = WRITE_ACKED;
+    return sendDataToPeripheral(CHARACTERISTIC_UUID, pClient, value, mode);
+}
+
+/**
+ * @brief Adds a voltage reading to the device's stats and marks the state document dirty on a large enough change (BLE task only).
+ */
+void recordVoltage(int device, uint16_t mv) {
+    VoltageStats& stats = voltageStats[device];
+    if (stats.samples == 0 || mv < stats.minMv) stats.minMv = mv;
+    if (stats.samples == 0 || mv > stats.maxMv) stats.maxMv = mv;
+    stats.lastMv = mv;
+    stats.sumMv += mv;
+    stats.samples++;
+    if (abs((int)mv - (int)documentedMv[device]) >= STATE_VOLTAGE_STEP_MV) stateChanged = true;
+}
+
+/**
+ * @brief Forwards queued BLE voltage notifications to the network task.
+ */
+void ble_notified() {
+    VoltageNotification notification;
+    while (bleClient.notifications.pop(notification))
     {
+        if (notification.index < 0 || notification.index >= MAX_CLIENTS) continue;
+        const uint16_t mv = notification.millivolts;
+        recordVoltage(notification.index, mv);
+        if (notification.format == VOLTAGE_BINARY) voltageStats[notification.index].binarySamples++;
+
+        char voltage[12];
+        const int length = formatVolts(mv, voltage, sizeof(voltage));
+        trafficRecorder.record(TRACE_BLE_NOTIFY, notification.index, voltage, length);
+        postEvent(EVT_VOLTAGE, notification.index, voltage, mv);
+    }
+}
+
+/**
+ * @brief Publishes an event from the BLE task to Blynk or the WebSocket clients (network task only).
+ */
+void publishEvent(const GatewayEvent& event, WebSocketsServer& webSocket) {
+    if (event.kind == EVT_STATUS)
+    {
+#if USE_BLYNK == false
+        webSocket.broadcastTXT(event.text);
+#endif
+        return;
+    }
 #if USE_BLYNK == true
-        Serial.printf("Blynk virtual write: %d. Data: %s\n", VOLTAGE_START_PIN + bleClient.notifty_index, bleClient.per_voltage.c_str()); 
-        Blynk.virtualWrite(VOLTAGE_START_PIN + bleClient.notifty_index , atof(bleClient.per_voltage.c_str()));
-        delay(100); // Delay to ensure Blynk processes the write
+    Serial.printf("Blynk virtual write: %d. Data: %s\n", VOLTAGE_START_PIN + event.device, event.text); 
+    Blynk.virtualWrite(VOLTAGE_START_PIN + event.device, event.millivolts / 1000.0f);
+    delay(100); // Delay to ensure Blynk processes the write
 #else
-        std::string statusMessage;
-        if (bleClient.notifty_index == 0)   statusMessage = "voltage_ac:" + bleClient.per_voltage;
-        else    statusMessage = "voltage_damper" + std::to_string(bleClient.notifty_index) + ":" + bleClient.per_voltage;
-        String statusMessageStr = String(statusMessage.c_str());
-        webSocket.broadcastTXT(statusMessageStr);
+    FixedString<48> statusMessage;
+    if (event.device == 0)   statusMessage.append("voltage_ac:").append(event.text);
+    else    statusMessage.appendf("voltage_damper%d:%s", event.device, event.text);
+    webSocket.broadcastTXT(statusMessage.c_str(), statusMessage.length());
 #endif
-    }
-    bleClient.notified = false;
-    bleClient.notifty_index = -1;
 }
 
-// static unsigned long lastBlynkUpdate = 0;
 /**
-    * @brief Handles BLE connection and notification events.
-    */
-void ble_loop(WebSocketsServer& webSocket) {
+ * @brief Prints the depth, high-water mark and drop count of a queue.
+ */
+template <typename Queue>
+void printQueueStats(const char* name, const Queue& queue) {
+    Serial.printf("[stats] queue %-6s depth %u/%u  high %u  drops %lu\n", name, (unsigned)queue.size(),
+                  (unsigned)queue.capacity(), (unsigned)queue.highWater(), (unsigned long)queue.drops());
+}
 
-    if(bleClient.doConnect)
-    {
-        bleClient.connectToDevice();
-        bleClient.doConnect = false;
-        bleClient.startScanning();
-    }
-    if (bleClient.notified) ble_notified(webSocket);
-    
-    // unsigned long currentTime = millis();
-    
-    // // Update Blynk every 10 seconds
-    // if (currentTime - lastBlynkUpdate >= 10000) {
-    //     Serial.println(bleClient.WORKING_ROOM_DUMPER_CONNECTED ? "Working room damper connected!" : "Working room damper NOT connected!");
-    //     Serial.println(bleClient.PARENTS_ROOM_DUMPER_CONNECTED ? "Parents room damper connected!" : "Parents room damper NOT connected!");
-    //     Serial.println(bleClient.SAFE_ROOM_DUMPER_CONNECTED ? "Safe room damper connected!" : "Safe room damper NOT connected!"); 
-    //     Serial.println(bleClient.AC_CONNECTED ? "AC connected!" : "AC NOT connected!");
-    //     lastBlynkUpdate = currentTime;
-    // }
-
-    if (wifiConnected)
-    {
-        if (!bleClient.isConnected())       BLE_connected(false);
-        else if (bleClient.isConnected())   BLE_connected(true);
+/**
+ * @brief Prints internal heap usage and fragmentation.
+ *
+ * Fragmentation is 100% minus the largest free block as a share of all free
+ * memory: 0% means the free heap is one contiguous block.
+ */
+void printHeapStats() {
+    const size_t freeBytes = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    const size_t largestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    const size_t minFree = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    const float fragmentation = freeBytes ? 100.0f - 100.0f * (float)largestBlock / (float)freeBytes : 0.0f;
+    Serial.printf("[stats] heap free %u B  min free %u B  largest block %u B  fragmentation %.1f%%\n",
+                  (unsigned)freeBytes, (unsigned)minFree, (unsigned)largestBlock, fragmentation);
+    const size_t psramFree = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    if (psramFree)
+        Serial.printf("[stats] psram free %u B  largest block %u B\n",
+                      (unsigned)psramFree, (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM));
+}
+
+/**
+ * @brief Prints per-task busy time, queue depths, heap and pool usage.
+ */
+void printTaskStats() {
+    TaskStats* tasks[] = {&networkTaskStats, &bleTaskStats};
+    for (TaskStats* task : tasks)
+        Serial.printf("[stats] task %-3s busy %5.1f%%  stack free %lu B  iterations %lu\n", task->name, task->takeBusyPercent(),
+                      (unsigned long)task->stackFree(), (unsigned long)task->iterations.load());
+    printQueueStats("cmd", commandQueue);
+    if (eventQueue) printQueueStats("event", *eventQueue);
+    printQueueStats("notify", bleClient.notifications);
+    printQueueStats("scan", bleClient.scanResults);
+    for (int i = 0; i < LINK_PROFILE_COUNT; ++i)
+        writeLatency[i].print(linkProfileNames[i]);
+    for (int i = 0; i < WRITE_MODE_COUNT; ++i)
+        commandWriteLatency[i].print(writeModeNames[i]);
+    Serial.printf("[stats] pipelined batches re-sent acked %lu\n", (unsigned long)pipelineFallbacks.load());
+    printHeapStats();
+    eventPool.printStats();
+    assetPool.printStats();
+    tracePool.printStats();
+    statePool.printStats();
+    if (stateDocumentStalls) Serial.printf("[stats] state document publishes postponed %lu\n", (unsigned long)stateDocumentStalls);
+    commandLatency.print("command");
+    reconcileLatency.print("reconcile");
+    federation.printStats();
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        const VoltageStats& stats = voltageStats[i];
+        if (stats.samples == 0) continue;
+        Serial.printf("[stats] voltage %d  last %u mV  min %u mV  max %u mV  avg %lu mV  samples %lu (%lu binary)\n", i,
+                      stats.lastMv, stats.minMv, stats.maxMv, (unsigned long)(stats.sumMv / stats.samples),
+                      (unsigned long)stats.samples, (unsigned long)stats.binarySamples);
     }
+    Serial.printf("[stats] voltage invalid payloads %lu\n", (unsigned long)bleClient.invalidVoltagePayloads.load());
 }
 
+// NVS (Non-Volatile Storage) store of the saved states (stateStore, see attachCommandPath)
+NvsStateStore nvsStore("storage");
 
-// NVS (Non-Volatile Storage) functions
 /**
- * @brief Saves a key-value pair to NVS (Non-Volatile Storage).
+ * @brief Loads saved states from NVS and broadcasts them to WebSocket clients.
  *
- * @param key The key to save.
- * @param state The value to save.
+ * @param webSocket The WebSocket server instance.
  */
-void saveState(const String& key, const String& state) {
+void loadServerData(WebSocketsServer& webSocket) {
+    static const char* const keys[] = {
+        "damper1_state", "damper1_power", "damper2_state", "damper2_power", "damper3_state", "damper3_power",
+        "ac_state", "ac_power", "ac_mode", "ac_temp"
+    };
+    char value[48];
+    Serial.println("Loaded states from NVS:");
+    for (const char* key : keys) {
+        if (loadState(key, value, sizeof(value)) && value[0] != '\0')   webSocket.broadcastTXT(value);
+        Serial.println(value);
+    }
+}
+
+ScheduleEntry schedules[MAX_SCHEDULES];  // Persisted in NVS as one blob (network task only)
+
+/**
+ * @brief Saves the schedule table to NVS.
+ */
+void saveSchedules() {
     nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open("storage", NVS_READWRITE, &nvs_handle);
-    if (err != ESP_OK) {
+    if (nvs_open("storage", NVS_READWRITE, &nvs_handle) != ESP_OK) {
         Serial.println("Error opening NVS handle!");
         return;
     }
-    err = nvs_set_str(nvs_handle, key.c_str(), state.c_str());
-    if (err != ESP_OK) {
-        Serial.println("Error setting NVS value!");
-    }
-    err = nvs_commit(nvs_handle);
-    if (err != ESP_OK) {
-        Serial.println("Error committing NVS value!");
-    }
+    if (nvs_set_blob(nvs_handle, "schedules", schedules, sizeof(schedules)) != ESP_OK || nvs_commit(nvs_handle) != ESP_OK)
+        Serial.println("Error saving schedules!");
     nvs_close(nvs_handle);
 }
 
 /**
- * @brief Loads a value from NVS based on the given key.
- *
- * @param key The key to retrieve the value for.
- * @return The value associated with the key, or an empty string if not found.
+ * @brief Loads the schedule table from NVS; leaves it empty if none was saved.
  */
-String loadState(const String& key) {
+void loadSchedules() {
+    memset(schedules, 0, sizeof(schedules));
     nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open("storage", NVS_READONLY, &nvs_handle);
-    if (err != ESP_OK) {
-        Serial.println("Error opening NVS handle!");
-        return "";
-    }
-    size_t required_size;
-    err = nvs_get_str(nvs_handle, key.c_str(), NULL, &required_size);
-    if (err != ESP_OK) {
-        Serial.println("Error getting NVS value size!");
-        nvs_close(nvs_handle);
-        return "";
-    }
-    char* value = (char*)malloc(required_size);
-    err = nvs_get_str(nvs_handle, key.c_str(), value, &required_size);
-    if (err != ESP_OK) {
-        Serial.println("Error getting NVS value!");
-        free(value);
-        nvs_close(nvs_handle);
-        return "";
-    }
-    String result = String(value);
-    free(value);
+    if (nvs_open("storage", NVS_READONLY, &nvs_handle) != ESP_OK) return;
+    size_t size = sizeof(schedules);
+    if (nvs_get_blob(nvs_handle, "schedules", schedules, &size) != ESP_OK || size != sizeof(schedules))
+        memset(schedules, 0, sizeof(schedules));
     nvs_close(nvs_handle);
-    return result;
 }
 
 /**
- * @brief Loads saved states from NVS and broadcasts them to WebSocket clients.
+ * @brief Queues the commands of the schedules due this minute (network task timer job).
  *
- * @param webSocket The WebSocket server instance.
+ * Runs on the local clock, which keeps time after the first SNTP sync even
+ * while Wi-Fi is down. Each minute is handled once.
  */
-void loadServerData(WebSocketsServer& webSocket) {
-    // Load and apply saved states for dampers and AC
-    for (int i = 0; i < 3; ++i) {
-        String damperState = loadState("damper" + String(i + 1) + "_state");
-        if (damperState != "") webSocket.broadcastTXT(damperState);
+void runDueSchedules(void*) {
+    const time_t now = time(nullptr);
+    if (now < 1700000000) return;  // Clock never synced
+    struct tm local;
+    localtime_r(&now, &local);
+    static int lastMinute = -1;
+    const int minuteOfYear = (local.tm_yday * 24 + local.tm_hour) * 60 + local.tm_min;
+    if (minuteOfYear == lastMinute) return;
+    lastMinute = minuteOfYear;
+    for (const ScheduleEntry& entry : schedules) {
+        if (!entry.used || entry.hour != local.tm_hour || entry.minute != local.tm_min) continue;
+        Serial.printf("[schedule] %02u:%02u device %d: %s\n", entry.hour, entry.minute, entry.device, entry.value);
+        queueCommand((CommandKind)entry.kind, entry.device, entry.value);
+    }
+}
+
+/**
+ * @brief Prints the task/queue/heap stats (network task timer job).
+ */
+void statsJob(void*) {
+    printTaskStats();
+}
 
-        String damperPower = loadState("damper" + String(i + 1) + "_power");
-        if (damperPower != "") webSocket.broadcastTXT(damperPower);
+/**
+ * @brief Starts the periodic jobs of the network task and loads the schedules.
+ */
+void startNetworkJobs() {
+    loadSchedules();
+    networkTimers.begin(millis());
+    networkTimers.schedule(SCHEDULE_CHECK_MS, runDueSchedules, nullptr, SCHEDULE_CHECK_MS);
+    networkTimers.schedule(STATS_PERIOD_MS, statsJob, nullptr, STATS_PERIOD_MS);
+}
+
+/**
+ * @brief Parsed UUID of a control characteristic.
+ */
+const NimBLEUUID& controlUUID(int field) {
+    static const NimBLEUUID uuids[CONTROL_COUNT] = {
+        NimBLEUUID(STATE_UUID), NimBLEUUID(VENT_SPEED_UUID), NimBLEUUID(MODE_UUID), NimBLEUUID(TEMP_UUID)
+    };
+    return uuids[field];
+}
 
-        Serial.println("Loaded states from NVS:");
-        Serial.println(damperState);
-        Serial.println(damperPower);
+/**
+ * @class BleControlLink
+ * @brief ControlLink over the NimBLE clients of bleClient (BLE task only).
+ */
+class BleControlLink : public ControlLink {
+public:
+    LinkProfile markActivity(int device) override { return bleClient.markActivity(device); }
+
+    bool write(int device, int field, const char* value, WriteMode& mode) override {
+        return sendDataToPeripheral(controlUUID(field), bleClient.getClientForDamper(device), value, mode);
     }
 
-    String acState = loadState("ac_state");
-    if (acState != "") webSocket.broadcastTXT(acState);
+    bool read(int device, int field, char* value, size_t size) override {
+        value[0] = '\0';
+        static const NimBLEUUID serviceUUID(SERVICE_UUID);
+        NimBLEClient* pClient = bleClient.getClientForDamper(device);
+        NimBLERemoteService* pService = pClient ? pClient->getService(serviceUUID) : nullptr;
+        NimBLERemoteCharacteristic* pCharacteristic = pService ? pService->getCharacteristic(controlUUID(field)) : nullptr;
+        return pCharacteristic && BLEClientMulti::readCharacteristic(pClient, pCharacteristic, value, size);
+    }
+};
 
-    String acPower = loadState("ac_power");
-    if (acPower != "") webSocket.broadcastTXT(acPower);
+BleControlLink bleControlLink;
 
-    String acMode = loadState("ac_mode");
-    if (acMode != "") webSocket.broadcastTXT(acMode);
+/**
+ * @brief Queues a status message of the command path for the clients and the peers (BLE task).
+ */
+void postControlStatus(int device, int field, const char* statusMessage, const GatewayCommand* cause) {
+    postEvent(EVT_STATUS, device, statusMessage, 0, field, cause);
+}
 
-    String acTemp = loadState("ac_temp");
-    if (acTemp != "") webSocket.broadcastTXT(acTemp);
+/**
+ * @brief Connects the command path to NVS, the BLE links and the event queue.
+ *        Must run after nvs_flash_init() and before the tasks are started.
+ */
+void attachCommandPath() {
+    nvsStore.begin();
+    stateStore = &nvsStore;
+    controlLink = &bleControlLink;
+    onControlStatus = postControlStatus;
+}
 
-    Serial.println("Loaded states from NVS:");
-    Serial.println(acTemp);
-    Serial.println(acState);
-    Serial.println(acPower);
-    Serial.println(acMode);
+/**
+ * @brief Queues a command forwarded by the gateway that received it (network task).
+ * @return False if the queue is full; the peer then re-sends the command.
+ */
+bool onFederatedCommand(const FederationCommand& command) {
+    return queueLocalCommand((CommandKind)command.kind, command.device, command.value, command.header.gatewayId, command.header.seq);
+}
+
+/**
+ * @brief Executes a command the owner never acknowledged on this gateway instead (network task).
+ *
+ * If this gateway is not connected to the device, the command stays pending until it is.
+ */
+void onForwardFailed(const FederationCommand& command) {
+    Serial.printf("[fed] command for device %d not acknowledged, executing locally\n", command.device);
+    queueLocalCommand((CommandKind)command.kind, command.device, command.value);
+}
+
+/**
+ * @brief Queues a change published by a peer for the local clients and for the BLE task (network task).
+ *
+ * The gateway view and NVS are updated by applyPeerDeltas() on the BLE task, which owns them.
+ */
+void onFederatedDelta(const FederationDelta& delta) {
+    if (delta.device < 0 || delta.device >= MAX_CLIENTS) return;
+    GatewayEvent event;
+    event.kind = (EventKind)delta.eventKind;
+    event.device = delta.device;
+    event.field = delta.field;
+    event.originGateway = FEDERATION_NO_OWNER;
+    event.originSeq = 0;
+    event.millivolts = delta.millivolts;
+    strlcpy(event.text, delta.text, sizeof(event.text));
+    if (!remoteEvents.push(event)) Serial.println("Remote event queue full, event dropped!");
+    if (!peerDeltas.push(event)) Serial.println("Peer delta queue full, delta dropped!");
+    else bleTaskStats.notify();
 }
 
-#endif
\ No newline at end of file
+/**
+ * @brief Applies the changes published by peers to the gateway view, the state document and NVS (BLE task only).
+ */
+void applyPeerDeltas() {
+    GatewayEvent event;
+    while (peerDeltas.pop(event))
+    {
+        if (event.kind == EVT_VOLTAGE)
+        {
+            recordVoltage(event.device, event.millivolts);
+            continue;
+        }
+        if (event.kind != EVT_STATUS || event.field < 0 || event.field >= CONTROL_COUNT) continue;
+        if (!deviceHasField(event.device, event.field)) continue;
+        const char* value = statusValue(event.text);
+        if (!value) continue;
+        // Only the owner writes to the device; a value still pending here is superseded by the owner's
+        strlcpy(deviceState[event.device][event.field], value, CONTROL_VALUE_SIZE);
+        pendingFields[event.device] &= (uint8_t)~(1 << event.field);
+        stateChanged = true;
+        // Keep NVS current so this gateway has the peer's state after a reboot or a handover
+        FixedString<40> statusMessage;
+        FixedString<16> key;
+        buildStatus(event.device, event.field, "", statusMessage, key);
+        saveState(key.c_str(), event.text);
+    }
+}
+
+/**
+ * @brief Restores the gateway view of every device from the status messages saved in NVS (BLE task).
+ */
+void restoreDeviceStates() {
+    char saved[48];
+    for (int device = 0; device < MAX_CLIENTS; ++device)
+        for (int field = 0; field < CONTROL_COUNT; ++field) {
+            deviceState[device][field][0] = '\0';
+            if (!deviceHasField(device, field)) continue;
+            FixedString<40> statusMessage;
+            FixedString<16> key;
+            buildStatus(device, field, "", statusMessage, key);
+            if (!loadState(key.c_str(), saved, sizeof(saved))) continue;
+            // Saved values look like "status_ac:on" or "ac_temp: 24"
+            const char* value = statusValue(saved);
+            if (!value) continue;
+            strlcpy(deviceState[device][field], value, CONTROL_VALUE_SIZE);
+        }
+}
+
+/**
+ * @brief Reconciles a freshly connected device with the gateway state (BLE task only).
+ *
+ * Policy, per control value:
+ *  - a value commanded while the device was away (pending) is the newest intent: the gateway wins and writes it;
+ *  - otherwise the peripheral wins, since it can only differ if it was changed locally (e.g. the physical
+ *    remote): the gateway adopts it, saves it and pushes it to clients;
+ *  - values the peripheral could not report are left as they are.
+ * Only the values that changed are pushed to clients.
+ *
+ * @param device The device index.
+ */
+void reconcileDevice(int device) {
+    ControlSnapshot& snapshot = bleClient.snapshots[device];
+    snapshot.ready = false;
+    unsigned adopted = 0;
+    unsigned written = 0;
+    for (int field = 0; field < CONTROL_COUNT; ++field) {
+        if (!deviceHasField(device, field)) continue;
+        const uint8_t bit = (uint8_t)(1 << field);
+        if (pendingFields[device] & bit)
+        {
+            WriteMode mode = WRITE_ACKED;
+            if (controlLink->write(device, field, deviceState[device][field], mode))
+            {
+                pendingFields[device] &= (uint8_t)~bit;
+                written++;
+            }
+        }
+        else if (snapshot.valid[field] && strcmp(snapshot.values[field], deviceState[device][field]) != 0)
+        {
+            strlcpy(deviceState[device][field], snapshot.values[field], CONTROL_VALUE_SIZE);
+            publishControlValue(device, field);
+            adopted++;
+        }
+    }
+    const uint32_t elapsedUs = (uint32_t)(esp_timer_get_time() - snapshot.linkUpUs);
+    reconcileLatency.record(elapsedUs);
+    Serial.printf("[reconcile] device %d: %u adopted from peripheral, %u pending written, consistent after %lu us\n",
+                  device, adopted, written, (unsigned long)elapsedUs);
+}
+
+/**
+ * @brief Serializes the state of every device into a new document version and publishes it (BLE task only).
+ *
+ * The document goes into a free slot; if every slot is still being sent, the publish is postponed
+ * (stateChanged stays set) and retried on the next loop.
+ */
+void publishStateDocument() {
+    static const uint32_t boot = esp_random();  // First publish runs with the radio on: true random
+    static uint32_t version = 0;
+    if (!stateDocuments) return;
+    StateDocument* document = nullptr;
+    for (int i = 0; i < STATE_DOCUMENT_SLOTS && !document; ++i)
+        if (stateDocuments[i].references.load(std::memory_order_acquire) == 0) document = &stateDocuments[i];
+    if (!document)
+    {
+        stateDocumentStalls++;
+        return;
+    }
+    document->boot = boot;
+    document->version = ++version;
+    FixedString<STATE_DOCUMENT_SIZE>& json = document->json;
+    bool connected[MAX_CLIENTS];
+    int32_t millivolts[MAX_CLIENTS];
+    for (int device = 0; device < MAX_CLIENTS; ++device) {
+        NimBLEClient* pClient = bleClient.getClientForDamper(device);
+        connected[device] = pClient && pClient->isConnected();
+        documentedMv[device] = voltageStats[device].lastMv;
+        millivolts[device] = voltageStats[device].samples ? (int32_t)documentedMv[device] : -1;
+    }
+    json.clear();
+    serializeStateDocument(json, boot, document->version, connected, millivolts);
+
+    document->references.store(1, std::memory_order_release);  // The published pointer's reference
+    portENTER_CRITICAL(&stateDocumentLock);
+    StateDocument* previous = stateDocument;
+    stateDocument = document;
+    portEXIT_CRITICAL(&stateDocumentLock);
+    // The previous slot is free again once the requests still sending it are done
+    StateDocumentRef released(previous);
+    stateChanged = false;
+}
+
+/**
+ * @brief Reports link quality of held devices and releases the ones a peer took over (BLE task timer job).
+ */
+void federationLinkJob(void*) {
+    if (!federation.isStarted()) return;
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        NimBLEClient* pClient = bleClient.getClientForDamper(i);
+        if (!pClient || !pClient->isConnected()) continue;
+        federation.observeLocal(i, pClient->getRssi(), true);
+        if (!federation.mayConnect(i))
+        {
+            Serial.printf("[fed] device %d handed over to gateway %u\n", i, federation.ownerOf(i));
+            bleClient.supervisor.onHandover(i);  // Our own disconnect: not a flapping link
+            pClient->disconnect();
+        }
+    }
+}
+
+/**
+ * @brief Switches idle links to power save (BLE task timer job).
+ */
+void relaxLinksJob(void*) {
+    bleClient.relaxIdleLinks();
+}
+
+/**
+ * @brief Prints the link parameters (BLE task timer job).
+ */
+void linkStatsJob(void*) {
+    bleClient.printLinkStats();
+}
+
+/**
+ * @brief Shows the BLE connection status on the LED once Wi-Fi is up (BLE task timer job).
+ */
+void refreshLedJob(void*) {
+    if (wifiConnected) BLE_connected(bleClient.isConnected());
+}
+
+/**
+ * @brief Starts the periodic jobs of the BLE task.
+ */
+void startBleJobs() {
+    bleTimers.begin(millis());
+    bleTimers.schedule(LED_REFRESH_MS, refreshLedJob, nullptr, LED_REFRESH_MS);
+    bleTimers.schedule(LINK_CHECK_MS, relaxLinksJob, nullptr, LINK_CHECK_MS);
+    bleTimers.schedule(FEDERATION_HEARTBEAT_MS, federationLinkJob, nullptr, FEDERATION_HEARTBEAT_MS);
+    bleTimers.schedule(STATS_PERIOD_MS, linkStatsJob, nullptr, STATS_PERIOD_MS);
+}
+
+/**
+ * @brief Executes the queued commands, then confirms their pipelined writes (BLE task only).
+ *
+ * Commands queued together are executed back to back, so their pipelined writes share connection events.
+ */
+void executeQueuedCommands() {
+    GatewayCommand command;
+    while (commandQueue.pop(command)) {
+        if (command.kind == CMD_TRACE_SNAPSHOT)     recordTraceSnapshot();
+        else                                        executeCommand(command);
+    }
+    confirmPipelinedWrites();  // One read back per device written in this batch
+}
+
+/**
+    * @brief Handles BLE connection and notification events (BLE task only).
+    */
+void ble_loop() {
+
+    bleClient.processDisconnects();
+    // Connection outcomes, scan results and scan restarts are handed over by the NimBLE host task
+    if (bleClient.processConnects() && bleClient.isConnected())  bootTimeline.mark(BOOT_BLE_CONNECTED);
+    bleClient.processScanResults();
+    static bool bootReported = false;
+    if (!bootReported && bootTimeline.hasReached(BOOT_BLE_CONNECTED) && bootTimeline.hasReached(BOOT_FIRST_COMMAND))
+    {
+        bootTimeline.print();
+        bootReported = true;
+    }
+    ble_notified();
+    applyPeerDeltas();
+    for (int i = 0; i < MAX_CLIENTS; ++i)
+        if (bleClient.snapshots[i].ready) reconcileDevice(i);
+
+    // Periodic jobs: LED, link profiles, federation, link stats (clients are only touched from this task)
+    bleTimers.advance(millis());
+    if (stateChanged) publishStateDocument();  // Once per loop, however many values changed
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#ifdef ARDUINO
+#include "Arduino.h"
+#endif
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @class LatencyStats
+ * @brief Keeps the most recent latency samples and reports percentiles.
+ *
+ * One task records, any task may report. A report taken while samples are
+ * being recorded is approximate, which is fine for telemetry.
+ */
+class LatencyStats {
+public:
+    static const size_t SAMPLES = 256;  ///< Number of most recent samples kept
+
+    /**
+     * @brief Record one latency sample.
+     * @param us Latency in microseconds.
+     */
+    void record(uint32_t us) {
+        const uint32_t n = total.load(std::memory_order_relaxed);
+        samples[n % SAMPLES] = us;
+        total.store(n + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Forget all samples.
+     */
+    void reset() { total.store(0, std::memory_order_release); }
+
+    /**
+     * @brief Number of samples recorded since the last reset.
+     */
+    uint32_t count() const { return total.load(std::memory_order_acquire); }
+
+#ifdef ARDUINO
+    /**
+     * @brief Print count, p50, p90, p99 and max of the kept samples.
+     * @param label Name printed in front of the numbers.
+     */
+    void print(const char* label) const {
+        const uint32_t n = count();
+        if (n == 0) {
+            Serial.printf("[latency] %-12s no samples\n", label);
+            return;
+        }
+        const size_t kept = n < SAMPLES ? n : SAMPLES;
+        uint32_t sorted[SAMPLES];
+        std::copy(samples, samples + kept, sorted);
+        std::sort(sorted, sorted + kept);
+        Serial.printf("[latency] %-12s n %lu  p50 %lu us  p90 %lu us  p99 %lu us  max %lu us\n", label, (unsigned long)n,
+                      (unsigned long)sorted[(kept - 1) * 50 / 100], (unsigned long)sorted[(kept - 1) * 90 / 100],
+                      (unsigned long)sorted[(kept - 1) * 99 / 100], (unsigned long)sorted[kept - 1]);
+    }
+#endif
+
+private:
+    uint32_t samples[SAMPLES] = {0};
+    std::atomic<uint32_t> total{0};
+};
+
+#endif // LATENCY_STATS_H
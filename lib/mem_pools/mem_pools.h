@@ -0,0 +1,104 @@
+#ifndef MEM_POOLS_H
+#define MEM_POOLS_H
+
+#include "Arduino.h"
+#include <atomic>
+#include <new>
+#include <esp_heap_caps.h>
+
+/**
+ * @brief Where a pool places its allocations.
+ */
+enum MemRegion : uint8_t {
+    MEM_INTERNAL,  ///< Internal SRAM: small, hot objects
+    MEM_PSRAM      ///< External PSRAM: large, latency-tolerant buffers
+};
+
+/**
+ * @class MemPool
+ * @brief Named allocation pool bound to a memory region, with usage statistics.
+ *
+ * PSRAM pools fall back to internal RAM when PSRAM is missing or exhausted;
+ * such allocations are counted as fallbacks so they show up in the report.
+ * Pools may be used from any task.
+ */
+class MemPool {
+public:
+    MemPool(const char* name, MemRegion region) : name(name), region(region) {}
+
+    const char* const name;
+    const MemRegion region;
+
+    /**
+     * @brief Allocate a block from the pool's region.
+     * @param size Size in bytes.
+     * @return The block, or nullptr if no memory is left.
+     */
+    void* allocate(size_t size) {
+        void* ptr = nullptr;
+        if (region == MEM_PSRAM) {
+            ptr = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+            if (!ptr) fallbacks.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (!ptr) ptr = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        if (!ptr) {
+            failures.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        const size_t used = bytesInUse.fetch_add(size, std::memory_order_relaxed) + size;
+        size_t peak = peakBytes.load(std::memory_order_relaxed);
+        while (used > peak && !peakBytes.compare_exchange_weak(peak, used, std::memory_order_relaxed)) {}
+        return ptr;
+    }
+
+    /**
+     * @brief Return a block to the pool.
+     * @param ptr The block returned by allocate().
+     * @param size The size that was requested for it.
+     */
+    void release(void* ptr, size_t size) {
+        if (!ptr) return;
+        heap_caps_free(ptr);
+        bytesInUse.fetch_sub(size, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Allocate and default-construct an object in the pool.
+     * @return The object, or nullptr if no memory is left.
+     */
+    template <typename T>
+    T* create() {
+        void* ptr = allocate(sizeof(T));
+        return ptr ? new (ptr) T() : nullptr;
+    }
+
+    /**
+     * @brief Destroy an object created with create().
+     */
+    template <typename T>
+    void destroy(T* object) {
+        if (!object) return;
+        object->~T();
+        release(object, sizeof(T));
+    }
+
+    /**
+     * @brief Print usage statistics to the serial console.
+     */
+    void printStats() const {
+        Serial.printf("[stats] pool %-8s %-8s in use %u B  peak %u B  allocs %lu  fallbacks %lu  failures %lu\n",
+                      name, region == MEM_PSRAM ? "psram" : "internal",
+                      (unsigned)bytesInUse.load(), (unsigned)peakBytes.load(), (unsigned long)allocations.load(),
+                      (unsigned long)fallbacks.load(), (unsigned long)failures.load());
+    }
+
+private:
+    std::atomic<size_t> bytesInUse{0};
+    std::atomic<size_t> peakBytes{0};
+    std::atomic<uint32_t> allocations{0};
+    std::atomic<uint32_t> fallbacks{0};  ///< PSRAM requests served from internal RAM
+    std::atomic<uint32_t> failures{0};
+};
+
+#endif // MEM_POOLS_H
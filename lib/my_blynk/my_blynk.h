@@ -17,42 +17,50 @@
 #define DAMPER3_VOLTAGE     V10
 
 // =========== VIRTUAL WRITE HANDLERS =============
+// Handlers run on the network task (Blynk.run()) and only queue commands for the BLE task.
+
+/**
+ * @brief Queues an on/off command from a Blynk switch and records the first command of the boot.
+ */
+void queueBlynkCommand(int device, int on) {
+    bootTimeline.mark(BOOT_FIRST_COMMAND);
+    queueCommand(CMD_SET_STATE, device, on ? "on" : "off");
+}
 
 // AC Power (V0)
 BLYNK_WRITE(VPIN_POWER) {
-    sendDataToPeripheral(NimBLEUUID(STATE_UUID), bleClient.getClientForDamper(VPIN_POWER), param.asInt() ? "on" : "off");
+    queueBlynkCommand(VPIN_POWER, param.asInt());
 }
 
 
 // Damper 1 Power (V1)
 BLYNK_WRITE(VPIN_DAMPER1) {
-    sendDataToPeripheral(NimBLEUUID(STATE_UUID), bleClient.getClientForDamper(VPIN_DAMPER1), param.asInt() ? "on" : "off");
+    queueBlynkCommand(VPIN_DAMPER1, param.asInt());
 }
 
 // Damper 2 Power (V2)
 BLYNK_WRITE(VPIN_DAMPER2) {
-        sendDataToPeripheral(NimBLEUUID(STATE_UUID), bleClient.getClientForDamper(VPIN_DAMPER2), param.asInt() ? "on" : "off");
+        queueBlynkCommand(VPIN_DAMPER2, param.asInt());
 }
 
 // Damper 3 Power (V3)
 BLYNK_WRITE(VPIN_DAMPER3) {
-        sendDataToPeripheral(NimBLEUUID(STATE_UUID), bleClient.getClientForDamper(VPIN_DAMPER3),
-                             param.asInt() ? "on" : "off");
+        queueBlynkCommand(VPIN_DAMPER3, param.asInt());
 }
 
 // Temperature slider (V4)
 BLYNK_WRITE(VPIN_TEMPERATURE) {
-    sendDataToPeripheral(NimBLEUUID(STATE_UUID), bleClient.getClientForDamper(VPIN_POWER), param.asInt() ? "on" : "off");
+    queueBlynkCommand(VPIN_POWER, param.asInt());
 }
 
 // AC Mode (V5)
 BLYNK_WRITE(VPIN_POWER_STATE) {
-    sendDataToPeripheral(NimBLEUUID(STATE_UUID), bleClient.getClientForDamper(VPIN_POWER), param.asInt() ? "on" : "off");
+    queueBlynkCommand(VPIN_POWER, param.asInt());
 }
 
 // Fan Speed or Mode (V6)
 BLYNK_WRITE(VPIN_AC_STATE) {
-    sendDataToPeripheral(NimBLEUUID(STATE_UUID), bleClient.getClientForDamper(VPIN_POWER), param.asInt() ? "on" : "off");
+    queueBlynkCommand(VPIN_POWER, param.asInt());
 }
 
 
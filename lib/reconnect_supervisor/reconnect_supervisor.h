@@ -0,0 +1,191 @@
+#ifndef RECONNECT_SUPERVISOR_H
+#define RECONNECT_SUPERVISOR_H
+
+#include "Arduino.h"
+
+#define SUPERVISOR_MAX_DEVICES 8
+#define RECONNECT_MIN_RSSI -90           // Weaker advertisements are not worth a blocking connect
+#define RECONNECT_FLAPPING_RSSI -80      // A flapping device must be heard at least this well
+#define RECONNECT_BACKOFF_BASE_MS 1000   // Backoff after the first failure, doubled per failure
+#define RECONNECT_BACKOFF_MAX_MS 60000
+#define RECONNECT_JITTER_PERCENT 25      // Backoff is randomised by +/- this much
+#define FLAP_DISCONNECTS 3               // This many short-lived links within FLAP_WINDOW_MS ...
+#define FLAP_WINDOW_MS 60000
+#define FLAP_HOLDOFF_MS 60000            // ... keep the device off for this long
+#define STABLE_LINK_MS 30000             // A link that lived this long clears the flapping history
+
+/**
+ * @brief Reconnect state of a device.
+ */
+enum ReconnectState : uint8_t {
+    RECONNECT_IDLE = 0,   ///< Not connected, may be connected as soon as it is heard
+    RECONNECT_CONNECTED,
+    RECONNECT_BACKOFF,    ///< Waiting after failed connection attempts
+    RECONNECT_FLAPPING,   ///< Held off after repeated short-lived links
+    RECONNECT_STATE_COUNT
+};
+
+static const char* const reconnectStateNames[RECONNECT_STATE_COUNT] = {"idle", "connected", "backoff", "flapping"};
+
+/**
+ * @class ReconnectSupervisor
+ * @brief Per-device reconnect policy: RSSI gating, exponential backoff with jitter and flap detection.
+ *
+ * A connection attempt blocks the BLE task, so attempts on a device that is
+ * out of range or keeps dropping would delay commands for every other device.
+ * The supervisor decides when an advertised device is worth an attempt.
+ * BLE task only.
+ */
+class ReconnectSupervisor {
+public:
+    /**
+     * @brief Decide whether to attempt a connection to an advertised device.
+     * @param device The device index.
+     * @param rssi The advertisement RSSI in dBm.
+     * @param nowMs The current time (millis()).
+     * @return True if a connection attempt may be made now.
+     */
+    bool mayAttempt(int device, int rssi, uint32_t nowMs) {
+        if (device < 0 || device >= SUPERVISOR_MAX_DEVICES) return true;
+        DeviceLink& link = links[device];
+        link.lastRssi = (int8_t)rssi;
+        if (link.state == RECONNECT_CONNECTED) return false;
+        if ((link.state == RECONNECT_BACKOFF || link.state == RECONNECT_FLAPPING) && (int32_t)(nowMs - link.nextAttemptMs) < 0) {
+            link.backoffSkips++;
+            return false;
+        }
+        const int minRssi = link.state == RECONNECT_FLAPPING ? RECONNECT_FLAPPING_RSSI : RECONNECT_MIN_RSSI;
+        if (rssi < minRssi) {
+            link.rssiSkips++;
+            return false;
+        }
+        link.attempts++;
+        link.attemptStartMs = nowMs;
+        return true;
+    }
+
+    /**
+     * @brief Record a failed connection attempt and back off.
+     */
+    void onConnectFailed(int device, uint32_t nowMs) {
+        if (device < 0 || device >= SUPERVISOR_MAX_DEVICES) return;
+        DeviceLink& link = links[device];
+        link.failures++;
+        if (link.consecutiveFailures < 31) link.consecutiveFailures++;
+        if (link.state != RECONNECT_FLAPPING) link.state = RECONNECT_BACKOFF;
+        link.nextAttemptMs = nowMs + backoffMs(link.consecutiveFailures);
+    }
+
+    /**
+     * @brief Record a successful connection.
+     */
+    void onConnected(int device, uint32_t nowMs) {
+        if (device < 0 || device >= SUPERVISOR_MAX_DEVICES) return;
+        DeviceLink& link = links[device];
+        link.state = RECONNECT_CONNECTED;
+        link.handingOver = false;
+        link.consecutiveFailures = 0;
+        link.connects++;
+        link.connectedSinceMs = nowMs;
+        link.lastConnectMs = nowMs - link.attemptStartMs;
+    }
+
+    /**
+     * @brief Record that the gateway is about to drop the link on purpose (handed over to a peer gateway).
+     *
+     * The disconnect that follows is not a short-lived link and never counts towards flapping.
+     */
+    void onHandover(int device) {
+        if (device < 0 || device >= SUPERVISOR_MAX_DEVICES) return;
+        links[device].handingOver = true;
+    }
+
+    /**
+     * @brief Record a dropped link; enters the flapping state after repeated short-lived links.
+     */
+    void onDisconnected(int device, uint32_t nowMs) {
+        if (device < 0 || device >= SUPERVISOR_MAX_DEVICES) return;
+        DeviceLink& link = links[device];
+        link.disconnects++;
+        if (link.handingOver) {
+            link.handingOver = false;
+            link.handovers++;
+            link.state = RECONNECT_IDLE;
+            return;
+        }
+        if (nowMs - link.connectedSinceMs >= STABLE_LINK_MS) link.shortLinks = 0;
+        if (link.shortLinks == 0 || nowMs - link.firstShortLinkMs > FLAP_WINDOW_MS) {
+            link.shortLinks = 0;
+            link.firstShortLinkMs = nowMs;
+        }
+        if (nowMs - link.connectedSinceMs < STABLE_LINK_MS) link.shortLinks++;
+        if (link.shortLinks >= FLAP_DISCONNECTS) {
+            link.state = RECONNECT_FLAPPING;
+            link.flaps++;
+            link.shortLinks = 0;
+            link.nextAttemptMs = nowMs + FLAP_HOLDOFF_MS;
+            Serial.printf("[link] device %d is flapping, holding off for %u s\n", device, FLAP_HOLDOFF_MS / 1000);
+        }
+        else    link.state = RECONNECT_IDLE;
+    }
+
+    ReconnectState state(int device) const {
+        return device >= 0 && device < SUPERVISOR_MAX_DEVICES ? links[device].state : RECONNECT_IDLE;
+    }
+
+    /**
+     * @brief Print the link quality and reconnect counters of every device seen so far.
+     */
+    void printStats() const {
+        const uint32_t now = millis();
+        for (int i = 0; i < SUPERVISOR_MAX_DEVICES; ++i) {
+            const DeviceLink& link = links[i];
+            if (link.attempts == 0 && link.rssiSkips == 0) continue;
+            const int32_t waitMs = (link.state == RECONNECT_BACKOFF || link.state == RECONNECT_FLAPPING)
+                ? (int32_t)(link.nextAttemptMs - now) : 0;
+            Serial.printf("[link] device %d  %-9s  rssi %d  attempts %lu  connects %lu  failures %lu  disconnects %lu  "
+                          "handovers %lu  flaps %lu  skipped rssi %lu backoff %lu  last connect %lu ms  retry in %ld ms\n",
+                          i, reconnectStateNames[link.state], link.lastRssi, (unsigned long)link.attempts,
+                          (unsigned long)link.connects, (unsigned long)link.failures, (unsigned long)link.disconnects,
+                          (unsigned long)link.handovers, (unsigned long)link.flaps, (unsigned long)link.rssiSkips,
+                          (unsigned long)link.backoffSkips, (unsigned long)link.lastConnectMs, (long)(waitMs > 0 ? waitMs : 0));
+        }
+    }
+
+private:
+    struct DeviceLink {
+        ReconnectState state = RECONNECT_IDLE;
+        int8_t lastRssi = 0;              ///< RSSI of the last advertisement
+        uint8_t consecutiveFailures = 0;
+        uint8_t shortLinks = 0;           ///< Short-lived links in the current flap window
+        bool handingOver = false;         ///< The next disconnect is the gateway's own (see onHandover)
+        uint32_t nextAttemptMs = 0;
+        uint32_t attemptStartMs = 0;
+        uint32_t connectedSinceMs = 0;
+        uint32_t firstShortLinkMs = 0;
+        uint32_t lastConnectMs = 0;       ///< Duration of the last successful connect, discovery included
+        uint32_t attempts = 0;
+        uint32_t connects = 0;
+        uint32_t failures = 0;
+        uint32_t disconnects = 0;
+        uint32_t handovers = 0;           ///< Disconnects made on purpose, not counted as short links
+        uint32_t flaps = 0;
+        uint32_t rssiSkips = 0;           ///< Advertisements ignored for weak RSSI
+        uint32_t backoffSkips = 0;        ///< Advertisements ignored while backing off
+    };
+
+    DeviceLink links[SUPERVISOR_MAX_DEVICES];
+
+    /**
+     * @brief Exponential backoff with jitter, so devices that failed together do not retry together.
+     */
+    static uint32_t backoffMs(uint8_t failures) {
+        uint32_t delay = RECONNECT_BACKOFF_BASE_MS;
+        for (uint8_t i = 1; i < failures && delay < RECONNECT_BACKOFF_MAX_MS; ++i) delay *= 2;
+        if (delay > RECONNECT_BACKOFF_MAX_MS) delay = RECONNECT_BACKOFF_MAX_MS;
+        const uint32_t jitter = delay * RECONNECT_JITTER_PERCENT / 100;
+        return delay - jitter + esp_random() % (2 * jitter + 1);
+    }
+};
+
+#endif // RECONNECT_SUPERVISOR_H
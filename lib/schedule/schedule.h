@@ -0,0 +1,78 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include "command_path.h"
+#include "fixed_string.h"
+
+// Daily schedules: the entry format shared by the "schedule_*" WebSocket
+// messages and the table saved in NVS. Parsing and formatting are kept free of
+// Arduino headers so they are tested on the host (test/test_schedule); the
+// table, NVS and the clock stay in global_var.h.
+
+#define MAX_SCHEDULES 16
+
+/**
+ * @brief A command run every day at a local time, e.g. "23:00 damper2 state off".
+ */
+struct ScheduleEntry {
+    uint8_t used;
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t kind;    ///< CommandKind
+    int8_t device;
+    char value[CONTROL_VALUE_SIZE];
+};
+
+/**
+ * @brief Parses "HH:MM <device> <field> <value>", e.g. "23:00 damper2 state off" or "07:30 ac temp 24".
+ *
+ * Devices are "ac" and "damper1".."damper3"; fields are state (on/off), power, mode (AC) and temp (AC).
+ * Anything after the value, or a value too long to store, makes the text invalid.
+ *
+ * @return False if the text is not a valid schedule; the entry is then left unchanged.
+ */
+bool parseSchedule(const char* text, ScheduleEntry& entry) {
+    unsigned hour, minute;
+    char device[10], field[8], value[CONTROL_VALUE_SIZE];
+    int consumed = 0;
+    if (sscanf(text, "%2u:%2u %9s %7s %11s %n", &hour, &minute, device, field, value, &consumed) != 5 ||
+        text[consumed] != '\0' || hour > 23 || minute > 59)
+        return false;
+    int8_t deviceIndex;
+    if (strcmp(device, "ac") == 0)  deviceIndex = 0;
+    else if (startsWith(device, "damper") && device[6] >= '1' && device[6] <= '3' && device[7] == '\0') deviceIndex = (int8_t)(device[6] - '0');
+    else return false;
+    uint8_t kind;
+    if (strcmp(field, "state") == 0)
+    {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) return false;
+        kind = CMD_SET_STATE;
+    }
+    else if (strcmp(field, "power") == 0)                       kind = CMD_POWER;
+    else if (strcmp(field, "mode") == 0 && deviceIndex == 0)    kind = CMD_MODE;
+    else if (strcmp(field, "temp") == 0 && deviceIndex == 0)    kind = CMD_TEMP;
+    else return false;
+    entry.used = 1;
+    entry.hour = (uint8_t)hour;
+    entry.minute = (uint8_t)minute;
+    entry.kind = kind;
+    entry.device = deviceIndex;
+    copyString(entry.value, value, sizeof(entry.value));
+    return true;
+}
+
+/**
+ * @brief Formats a schedule entry the way parseSchedule() reads it, prefixed with its index.
+ */
+void formatSchedule(int index, const ScheduleEntry& entry, FixedString<48>& text) {
+    static const char* const fields[] = {"state", "state", "power", "mode", "temp"};
+    text.appendf("schedule:%d %02u:%02u ", index, entry.hour, entry.minute);
+    if (entry.device == 0)  text.append("ac");
+    else                    text.appendf("damper%d", entry.device);
+    text.appendf(" %s %s", entry.kind <= CMD_TEMP ? fields[entry.kind] : "?", entry.value);
+}
+
+#endif // SCHEDULE_H
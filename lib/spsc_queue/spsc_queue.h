@@ -0,0 +1,98 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @class SpscQueue
+ * @brief Bounded lock-free single-producer/single-consumer ring buffer.
+ *
+ * Exactly one task may call push() and exactly one task may call pop().
+ * Elements are copied in and out, so T should be a small trivially
+ * copyable struct. One slot is kept free to tell "full" from "empty",
+ * so the usable capacity is N - 1.
+ *
+ * @tparam T Element type.
+ * @tparam N Number of slots, must be a power of two.
+ */
+template <typename T, size_t N>
+class SpscQueue {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+
+public:
+    /**
+     * @brief Append an element (producer side).
+     * @param item The element to copy into the queue.
+     * @return False if the queue was full and the element was dropped.
+     */
+    bool push(const T& item) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        const size_t next = (tail + 1) & (N - 1);
+        if (next == head_.load(std::memory_order_acquire)) {
+            drops_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        slots_[tail] = item;
+        tail_.store(next, std::memory_order_release);
+
+        const size_t depth = (next - head_.load(std::memory_order_relaxed)) & (N - 1);
+        if (depth > highWater_.load(std::memory_order_relaxed))
+            highWater_.store(depth, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * @brief Remove the oldest element (consumer side).
+     * @param item Receives the element.
+     * @return False if the queue was empty.
+     */
+    bool pop(T& item) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) return false;
+        item = slots_[head];
+        head_.store((head + 1) & (N - 1), std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Look at the oldest element without removing it (consumer side).
+     * @return Pointer to the element, or nullptr if the queue is empty.
+     */
+    const T* peek() const {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) return nullptr;
+        return &slots_[head];
+    }
+
+    /**
+     * @brief Current number of queued elements (approximate when read from a third task).
+     */
+    size_t size() const {
+        return (tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire)) & (N - 1);
+    }
+
+    bool empty() const { return size() == 0; }
+
+    static constexpr size_t capacity() { return N - 1; }
+
+    /**
+     * @brief Highest depth observed since boot.
+     */
+    size_t highWater() const { return highWater_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Number of elements dropped because the queue was full.
+     */
+    uint32_t drops() const { return drops_.load(std::memory_order_relaxed); }
+
+private:
+    T slots_[N];
+    std::atomic<size_t> head_{0};  ///< Next slot to read, written by the consumer only
+    std::atomic<size_t> tail_{0};  ///< Next slot to write, written by the producer only
+    std::atomic<size_t> highWater_{0};
+    std::atomic<uint32_t> drops_{0};
+};
+
+#endif // SPSC_QUEUE_H
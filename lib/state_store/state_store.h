@@ -0,0 +1,138 @@
+#ifndef STATE_STORE_H
+#define STATE_STORE_H
+
+#include <cstddef>
+#include <cstring>
+#include "fixed_string.h"
+#ifdef ARDUINO
+#include "Arduino.h"
+#include <nvs.h>
+#endif
+
+/**
+ * @class StateStore
+ * @brief Key/value storage for the saved status messages.
+ */
+class StateStore {
+public:
+    virtual ~StateStore() {}
+
+    /**
+     * @brief Save a value.
+     * @return False if the value could not be saved.
+     */
+    virtual bool write(const char* key, const char* value) = 0;
+
+    /**
+     * @brief Load a value.
+     * @param key The key to load.
+     * @param value Buffer that receives the value; set to an empty string on failure.
+     * @param size Size of the buffer in bytes.
+     * @return True if the value was found and fits in the buffer.
+     */
+    virtual bool read(const char* key, char* value, size_t size) = 0;
+};
+
+#ifdef ARDUINO
+/**
+ * @class NvsStateStore
+ * @brief StateStore backed by an NVS namespace (the firmware's store).
+ *
+ * The namespace is opened once and the handle kept: nvs_open allocates, so
+ * opening it per write would put a heap allocation on every command.
+ */
+class NvsStateStore : public StateStore {
+public:
+    explicit NvsStateStore(const char* nvsNamespace) : nvsNamespace(nvsNamespace) {}
+
+    /**
+     * @brief Open the namespace (after nvs_flash_init, before the tasks share the store).
+     *
+     * write() and read() open it on first use otherwise; may be called again after a failure.
+     * @return False if the namespace could not be opened.
+     */
+    bool begin() {
+        if (opened) return true;
+        opened = nvs_open(nvsNamespace, NVS_READWRITE, &handle) == ESP_OK;
+        if (!opened) Serial.println("Error opening NVS handle!");
+        return opened;
+    }
+
+    bool write(const char* key, const char* value) override {
+        if (!begin()) return false;
+        esp_err_t err = nvs_set_str(handle, key, value);
+        if (err != ESP_OK) {
+            Serial.println("Error setting NVS value!");
+        }
+        else {
+            err = nvs_commit(handle);
+            if (err != ESP_OK) {
+                Serial.println("Error committing NVS value!");
+            }
+        }
+        return err == ESP_OK;
+    }
+
+    bool read(const char* key, char* value, size_t size) override {
+        value[0] = '\0';
+        if (!begin()) return false;
+        size_t required_size = size;
+        const esp_err_t err = nvs_get_str(handle, key, value, &required_size);
+        if (err != ESP_OK) {
+            Serial.println("Error getting NVS value!");
+            value[0] = '\0';
+            return false;
+        }
+        return true;
+    }
+
+private:
+    const char* const nvsNamespace;
+    nvs_handle_t handle = 0;
+    bool opened = false;
+};
+#endif
+
+/**
+ * @class RamStateStore
+ * @brief StateStore in a fixed RAM table, for benchmarks and host tests (a stand-in for NVS without flash wear).
+ */
+class RamStateStore : public StateStore {
+public:
+    static const size_t ENTRIES = 32;
+    static const size_t KEY_SIZE = 16;    // NVS keys are at most 15 characters
+    static const size_t VALUE_SIZE = 48;
+
+    bool write(const char* key, const char* value) override {
+        Entry* freeEntry = nullptr;
+        for (Entry& entry : entries) {
+            if (entry.used && strcmp(entry.key, key) == 0) {
+                copyString(entry.value, value, VALUE_SIZE);
+                return true;
+            }
+            if (!entry.used && !freeEntry) freeEntry = &entry;
+        }
+        if (!freeEntry) return false;
+        freeEntry->used = true;
+        copyString(freeEntry->key, key, KEY_SIZE);
+        copyString(freeEntry->value, value, VALUE_SIZE);
+        return true;
+    }
+
+    bool read(const char* key, char* value, size_t size) override {
+        for (const Entry& entry : entries)
+            if (entry.used && strcmp(entry.key, key) == 0 && copyString(value, entry.value, size) < size) return true;
+        value[0] = '\0';
+        return false;
+    }
+
+private:
+    struct Entry {
+        bool used;
+        char key[KEY_SIZE];
+        char value[VALUE_SIZE];
+    };
+    Entry entries[ENTRIES] = {};
+};
+
+#endif // STATE_STORE_H
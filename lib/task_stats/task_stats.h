@@ -0,0 +1,82 @@
+#ifndef TASK_STATS_H
+#define TASK_STATS_H
+
+#include <atomic>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+/**
+ * @class TaskStats
+ * @brief Measures how much of the wall-clock time a task spends doing work.
+ *
+ * The owning task brackets each unit of work with beginWork()/endWork();
+ * another task periodically calls takeBusyPercent() to read and reset the
+ * busy time for the elapsed window. Busy time is wall-clock time, so it
+ * includes time the task spends blocked inside a unit of work (a BLE connect
+ * or read, a flash write): it is not CPU usage.
+ */
+class TaskStats {
+public:
+    explicit TaskStats(const char* name) : name(name) {}
+
+    const char* name;            ///< Task name used in reports
+    std::atomic<TaskHandle_t> handle{nullptr};  ///< FreeRTOS handle, set by the task itself (see attachCurrentTask)
+
+    /**
+     * @brief Record the calling task as the owner (first thing the owning task does).
+     *
+     * Set from inside the task rather than through xTaskCreate's out-parameter, which
+     * is written after the task may already be running and being notified.
+     */
+    void attachCurrentTask() { handle.store(xTaskGetCurrentTaskHandle(), std::memory_order_release); }
+
+    /**
+     * @brief Wake the owning task (any task); does nothing before the task started.
+     */
+    void notify() {
+        TaskHandle_t task = handle.load(std::memory_order_acquire);
+        if (task) xTaskNotifyGive(task);
+    }
+
+    /**
+     * @brief Mark the start of a unit of work (owning task only).
+     */
+    void beginWork() { workStartUs = esp_timer_get_time(); }
+
+    /**
+     * @brief Mark the end of a unit of work (owning task only).
+     */
+    void endWork() {
+        busyUs.fetch_add((uint32_t)(esp_timer_get_time() - workStartUs), std::memory_order_relaxed);
+        iterations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Busy percentage of the wall-clock time since the previous call; resets the window.
+     */
+    float takeBusyPercent() {
+        const int64_t now = esp_timer_get_time();
+        const uint32_t busy = busyUs.exchange(0, std::memory_order_relaxed);
+        const int64_t window = now - windowStartUs;
+        windowStartUs = now;
+        return window > 0 ? 100.0f * (float)busy / (float)window : 0.0f;
+    }
+
+    /**
+     * @brief Minimum free stack seen so far, in bytes.
+     */
+    uint32_t stackFree() const {
+        TaskHandle_t task = handle.load(std::memory_order_acquire);
+        return task ? (uint32_t)uxTaskGetStackHighWaterMark(task) : 0;
+    }
+
+    std::atomic<uint32_t> iterations{0};  ///< Work units completed since boot
+
+private:
+    int64_t workStartUs = 0;
+    int64_t windowStartUs = 0;
+    std::atomic<uint32_t> busyUs{0};
+};
+
+#endif // TASK_STATS_H
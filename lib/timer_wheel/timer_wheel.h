@@ -0,0 +1,233 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define TIMER_TICK_MS 10  // Resolution of every timer wheel
+
+typedef void (*TimerCallback)(void* arg);
+typedef uint32_t TimerId;  ///< Node index in the low 16 bits, generation in the high 16 bits; 0 is never a valid id
+
+/**
+ * @class TimerWheel
+ * @brief Hierarchical timer wheel with O(1) schedule and cancel.
+ *
+ * Four levels of 64 slots cover 2^24 ticks (~46 h at TIMER_TICK_MS). Timers
+ * are intrusive nodes from a fixed pool, linked into circular lists so cancel
+ * only unlinks. Timers on the higher levels move down one level each time the
+ * level below wraps around, so advancing costs O(1) per tick plus the timers
+ * that expire or move.
+ *
+ * Not thread-safe: a wheel belongs to the task that calls advance(), and
+ * callbacks run on that task. Callbacks may schedule and cancel timers,
+ * including their own.
+ *
+ * @tparam N Number of timers that can be scheduled at once (at most 65535).
+ */
+template <size_t N>
+class TimerWheel {
+    static_assert(N > 0 && N < 0xFFFF, "TimerWheel size must fit a 16-bit index");
+
+public:
+    TimerWheel() {
+        for (size_t level = 0; level < LEVELS; ++level)
+            for (size_t slot = 0; slot < SLOTS; ++slot)
+                slots[level][slot].next = slots[level][slot].prev = &slots[level][slot];
+        for (size_t i = 0; i < N; ++i) {
+            nodes[i].next = i + 1 < N ? &nodes[i + 1] : nullptr;
+            nodes[i].generation = 1;
+            nodes[i].state = NODE_FREE;
+        }
+        freeList = &nodes[0];
+    }
+
+    /**
+     * @brief Start the wheel at the current time, so the first advance() does not replay the uptime.
+     * @param nowMs The current time (e.g. millis()).
+     */
+    void begin(uint32_t nowMs) { currentTick = nowMs / TIMER_TICK_MS; }
+
+    /**
+     * @brief Schedule a callback.
+     * @param delayMs Time until the first run (rounded up to a tick, at least one tick).
+     * @param callback The function to call.
+     * @param arg Passed to the callback.
+     * @param periodMs Interval between later runs, 0 for a one-shot timer.
+     * @return The timer id, or 0 if the pool is exhausted.
+     */
+    TimerId schedule(uint32_t delayMs, TimerCallback callback, void* arg = nullptr, uint32_t periodMs = 0) {
+        Node* node = freeList;
+        if (!node) {
+            failures++;
+            return 0;
+        }
+        freeList = static_cast<Node*>(node->next);
+        const uint32_t delayTicks = toTicks(delayMs);
+        node->expires = currentTick + delayTicks;
+        node->periodTicks = periodMs ? toTicks(periodMs) : 0;
+        node->callback = callback;
+        node->arg = arg;
+        node->state = NODE_SCHEDULED;
+        place(node);
+        active++;
+        if (active > highWater) highWater = active;
+        return (TimerId)node->generation << 16 | (TimerId)(node - nodes);
+    }
+
+    /**
+     * @brief Cancel a timer. Cancelling an expired or unknown id does nothing.
+     * @return True if the timer was scheduled.
+     */
+    bool cancel(TimerId id) {
+        Node* node = lookup(id);
+        if (!node) return false;
+        if (node->state == NODE_RUNNING) {
+            node->state = NODE_CANCELLED;  // Released when its callback returns
+            return true;
+        }
+        unlink(node);
+        release(node);
+        return true;
+    }
+
+    /**
+     * @brief Whether a timer is still scheduled.
+     */
+    bool isScheduled(TimerId id) const {
+        const size_t index = id & 0xFFFF;
+        if (id == 0 || index >= N) return false;
+        const Node& node = nodes[index];
+        return node.generation == (id >> 16) && (node.state == NODE_SCHEDULED || node.state == NODE_RUNNING);
+    }
+
+    /**
+     * @brief Run every timer that expired up to nowMs.
+     * @param nowMs The current time (e.g. millis()).
+     * @return The number of callbacks that ran.
+     */
+    size_t advance(uint32_t nowMs) {
+        const uint32_t target = nowMs / TIMER_TICK_MS;
+        size_t ran = 0;
+        while ((int32_t)(target - currentTick) > 0) {
+            currentTick++;
+            // Level 0 wrapped: move the next slot of each higher level down
+            for (size_t level = 1; level < LEVELS && (currentTick & ((1u << (BITS * level)) - 1)) == 0; ++level)
+                cascade(level);
+            Link& head = slots[0][currentTick & MASK];
+            while (head.next != &head) {
+                Node* node = static_cast<Node*>(head.next);
+                unlink(node);
+                node->state = NODE_RUNNING;
+                node->callback(node->arg);
+                ran++;
+                if (node->state == NODE_RUNNING && node->periodTicks) {
+                    // Keep the cadence relative to the scheduled time, but never in the past
+                    node->expires += node->periodTicks;
+                    if ((int32_t)(node->expires - currentTick) <= 0) node->expires = currentTick + 1;
+                    node->state = NODE_SCHEDULED;
+                    place(node);
+                }
+                else    release(node);
+            }
+        }
+        return ran;
+    }
+
+    size_t size() const { return active; }            ///< Timers currently scheduled
+    size_t capacity() const { return N; }
+    size_t peak() const { return highWater; }         ///< Most timers scheduled at once
+    uint32_t poolFailures() const { return failures; }  ///< schedule() calls refused because the pool was empty
+
+private:
+    static const size_t LEVELS = 4;
+    static const uint32_t BITS = 6;
+    static const size_t SLOTS = 1u << BITS;
+    static const uint32_t MASK = SLOTS - 1;
+
+    enum NodeState : uint8_t { NODE_FREE, NODE_SCHEDULED, NODE_RUNNING, NODE_CANCELLED };
+
+    struct Link {
+        Link* next;
+        Link* prev;
+    };
+
+    struct Node : Link {
+        uint32_t expires;      ///< Tick at which the timer runs
+        uint32_t periodTicks;  ///< 0 for one-shot timers
+        TimerCallback callback;
+        void* arg;
+        uint16_t generation;   ///< Bumped on release so stale ids do not match
+        NodeState state;
+    };
+
+    Link slots[LEVELS][SLOTS];
+    Node nodes[N];
+    Node* freeList = nullptr;
+    uint32_t currentTick = 0;
+    size_t active = 0;
+    size_t highWater = 0;
+    uint32_t failures = 0;
+
+    static uint32_t toTicks(uint32_t ms) {
+        const uint32_t ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+        return ticks ? ticks : 1;
+    }
+
+    Node* lookup(TimerId id) {
+        const size_t index = id & 0xFFFF;
+        if (id == 0 || index >= N) return nullptr;
+        Node* node = &nodes[index];
+        if (node->generation != (id >> 16) || (node->state != NODE_SCHEDULED && node->state != NODE_RUNNING)) return nullptr;
+        return node;
+    }
+
+    /**
+     * @brief Link a node into the slot matching its distance to the current tick.
+     */
+    void place(Node* node) {
+        uint32_t delta = node->expires - currentTick;
+        if ((int32_t)delta < 0) {
+            node->expires = currentTick;
+            delta = 0;
+        }
+        size_t level = 0;
+        while (level + 1 < LEVELS && delta >= (1u << (BITS * (level + 1)))) level++;
+        if (level + 1 == LEVELS && delta >= (1u << (BITS * LEVELS))) {
+            node->expires = currentTick + (1u << (BITS * LEVELS)) - 1;  // Clamp to the wheel's range
+        }
+        Link& head = slots[level][(node->expires >> (BITS * level)) & MASK];
+        node->prev = head.prev;
+        node->next = &head;
+        head.prev->next = node;
+        head.prev = node;
+    }
+
+    static void unlink(Node* node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->next = node->prev = nullptr;
+    }
+
+    void release(Node* node) {
+        node->state = NODE_FREE;
+        if (++node->generation == 0) node->generation = 1;
+        node->next = freeList;
+        freeList = node;
+        active--;
+    }
+
+    /**
+     * @brief Move the timers of the current slot of a level to lower levels.
+     */
+    void cascade(size_t level) {
+        Link& head = slots[level][(currentTick >> (BITS * level)) & MASK];
+        while (head.next != &head) {
+            Node* node = static_cast<Node*>(head.next);
+            unlink(node);
+            place(node);
+        }
+    }
+};
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,217 @@
+#ifndef TRACE_REPLAY_H
+#define TRACE_REPLAY_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "command_path.h"
+#include "traffic_trace.h"
+
+// Replays a traffic recording (the "trace_dump" output) through the command
+// path on the host: the recorded device states are restored, the recorded
+// frames are parsed and executed against a RAM store and in-memory
+// peripherals, and each status message is compared with the one the frame
+// produced on the gateway. Nothing reaches the peripherals, NVS or the other
+// gateways, so a replay has no side effects.
+
+/**
+ * @brief Parses one line of a trace dump: "<us> <type> <device> <seq> <data>".
+ * @return False for comments ("# ...") and malformed lines.
+ */
+bool parseTraceLine(const char* line, TraceEvent& event) {
+    char type[16];
+    unsigned long timestampUs;
+    int device;
+    unsigned seq;
+    int consumed = 0;
+    if (sscanf(line, "%lu %15s %d %u%n", &timestampUs, type, &device, &seq, &consumed) != 4) return false;
+    int kind = 0;
+    while (kind < TRACE_EVENT_TYPE_COUNT && strcmp(type, traceEventNames[kind]) != 0) kind++;
+    if (kind == TRACE_EVENT_TYPE_COUNT) return false;
+    const char* data = line + consumed;
+    if (*data == ' ') data++;
+    size_t length = strcspn(data, "\r\n");
+    if (length > sizeof(event.data) - 1) length = sizeof(event.data) - 1;
+    event.timestampUs = (uint32_t)timestampUs;
+    event.type = (uint8_t)kind;
+    event.device = (int8_t)device;
+    event.seq = (uint16_t)seq;
+    event.length = (uint8_t)length;
+    memcpy(event.data, data, length);
+    event.data[length] = '\0';
+    return true;
+}
+
+/**
+ * @class ReplayControlLink
+ * @brief In-memory peripherals: connected as the recording says, every write succeeds and reads back.
+ */
+class ReplayControlLink : public ControlLink {
+public:
+    bool connected[MAX_CLIENTS] = {};
+    char values[MAX_CLIENTS][CONTROL_COUNT][CONTROL_VALUE_SIZE] = {};
+
+    LinkProfile markActivity(int) override { return LINK_DEFAULT; }
+
+    bool write(int device, int field, const char* value, WriteMode&) override {
+        if (!connected[device]) return false;
+        copyString(values[device][field], value, CONTROL_VALUE_SIZE);
+        return true;
+    }
+
+    bool read(int device, int field, char* value, size_t size) override {
+        value[0] = '\0';
+        return connected[device] && copyString(value, values[device][field], size) < size;
+    }
+};
+
+/**
+ * @brief Outcome of a replay.
+ */
+struct ReplayReport {
+    uint32_t frames = 0;         ///< Recorded frames
+    uint32_t commands = 0;       ///< Frames that parsed to a command and were executed
+    uint32_t statesRestored = 0; ///< Control values restored from the snapshot
+    uint32_t expected = 0;       ///< Recorded status messages caused by a recorded frame
+    uint32_t matched = 0;        ///< Replayed statuses equal to the recorded status of the same frame
+    uint32_t divergent = 0;      ///< Replayed statuses that differ from the recorded status of the same frame
+    uint32_t missing = 0;        ///< Recorded statuses the replay did not produce
+    uint32_t unexpected = 0;     ///< Replayed statuses without a recorded one (e.g. commands forwarded to a peer)
+    uint32_t elapsedUs = 0;      ///< Time spent executing the commands
+
+    bool identical() const { return divergent == 0 && missing == 0 && unexpected == 0; }
+
+    void print(FILE* out) const {
+        fprintf(out, "[replay] %lu frames, %lu commands, %lu states restored, %.1f commands/s\n",
+                (unsigned long)frames, (unsigned long)commands, (unsigned long)statesRestored,
+                elapsedUs ? commands * 1000000.0 / elapsedUs : 0.0);
+        fprintf(out, "[replay] status matched %lu/%lu, divergent %lu, missing %lu, unexpected %lu\n",
+                (unsigned long)matched, (unsigned long)expected, (unsigned long)divergent,
+                (unsigned long)missing, (unsigned long)unexpected);
+    }
+};
+
+/**
+ * @class TraceReplayer
+ * @brief Replays recorded events through executeCommand and compares the statuses, matched by frame.
+ *
+ * Takes over the command path globals (stateStore, controlLink, onControlStatus
+ * and the device state) while replaying; meant for host tools and tests.
+ */
+class TraceReplayer {
+public:
+    static const size_t MAX_EVENTS = 2048;  ///< The recorder's TRACE_MAX_EVENTS
+
+    /**
+     * @brief Replay a recording.
+     * @param events The recorded events, in recording order.
+     * @param count The number of events (at most MAX_EVENTS).
+     */
+    ReplayReport replay(const TraceEvent* events, size_t count) {
+        if (count > MAX_EVENTS) count = MAX_EVENTS;
+        this->events = events;
+        this->count = count;
+        report = ReplayReport();
+        memset(matchedStatus, 0, sizeof(matchedStatus));
+        attach();
+
+        // The snapshot first: the recorded frames were executed on top of it
+        for (size_t i = 0; i < count; ++i) {
+            const TraceEvent& event = events[i];
+            if (event.type == TRACE_STATE && validDevice(event.device)) restoreState(event);
+            if (event.type == TRACE_STATUS && event.seq) report.expected++;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            const TraceEvent& event = events[i];
+            if ((event.type == TRACE_BLE_CONNECT || event.type == TRACE_BLE_DISCONNECT) && validDevice(event.device))
+                link.connected[event.device] = event.type == TRACE_BLE_CONNECT;
+            else if (event.type == TRACE_WS_FRAME)
+                replayFrame(event);
+        }
+        confirmPipelinedWrites();
+        for (size_t i = 0; i < count; ++i)
+            if (events[i].type == TRACE_STATUS && events[i].seq && !matchedStatus[i]) report.missing++;
+        onControlStatus = nullptr;
+        current = nullptr;
+        return report;
+    }
+
+private:
+    ReplayControlLink link;
+    RamStateStore store;
+    const TraceEvent* events = nullptr;
+    size_t count = 0;
+    ReplayReport report;
+    bool matchedStatus[MAX_EVENTS];  ///< Recorded statuses already matched by a replayed one
+    static TraceReplayer* current;
+
+    static bool validDevice(int device) { return device >= 0 && device < MAX_CLIENTS; }
+
+    void attach() {
+        link = ReplayControlLink();
+        store = RamStateStore();
+        stateStore = &store;
+        controlLink = &link;
+        current = this;
+        onControlStatus = onStatus;
+        memset(deviceState, 0, sizeof(deviceState));
+        memset(pendingFields, 0, sizeof(pendingFields));
+        memset(writeBatches, 0, sizeof(writeBatches));
+    }
+
+    void restoreState(const TraceEvent& event) {
+        const char* value = strchr(event.data, ' ');
+        if (!value) return;
+        const size_t nameLength = (size_t)(value - event.data);
+        for (int field = 0; field < CONTROL_COUNT; ++field) {
+            if (strlen(fieldNames[field]) != nameLength || strncmp(event.data, fieldNames[field], nameLength) != 0) continue;
+            copyString(deviceState[event.device][field], value + 1, CONTROL_VALUE_SIZE);
+            copyString(link.values[event.device][field], value + 1, CONTROL_VALUE_SIZE);
+            report.statesRestored++;
+        }
+    }
+
+    void replayFrame(const TraceEvent& event) {
+        report.frames++;
+        GatewayCommand command;
+        int device;
+        const char* value;
+        if (!parseCommand(event.data, event.length, command.kind, device, value)) return;
+        command.device = (int8_t)device;
+        copyString(command.value, value, sizeof(command.value));
+        command.originGateway = FEDERATION_NO_OWNER;
+        command.originSeq = 0;
+        command.traceSeq = event.seq;
+        command.enqueuedUs = commandClockUs();
+        executeCommand(command);
+        report.elapsedUs += commandClockUs() - command.enqueuedUs;
+        report.commands++;
+    }
+
+    /**
+     * @brief Compares a replayed status with the recorded statuses of the same frame.
+     */
+    static void onStatus(int device, int, const char* statusMessage, const GatewayCommand* cause) {
+        TraceReplayer& self = *current;
+        if (!cause || !cause->traceSeq) return;  // Not caused by a replayed frame
+        bool recorded = false;
+        for (size_t i = 0; i < self.count; ++i) {
+            const TraceEvent& event = self.events[i];
+            if (event.type != TRACE_STATUS || event.seq != cause->traceSeq || event.device != device || self.matchedStatus[i]) continue;
+            self.matchedStatus[i] = true;
+            recorded = true;
+            if (strcmp(event.data, statusMessage) == 0) self.report.matched++;
+            else {
+                self.report.divergent++;
+                printf("[replay] divergence at frame %u: recorded \"%s\", got \"%s\"\n",
+                       (unsigned)cause->traceSeq, event.data, statusMessage);
+            }
+            break;
+        }
+        if (!recorded) self.report.unexpected++;
+    }
+};
+
+TraceReplayer* TraceReplayer::current = nullptr;
+
+#endif // TRACE_REPLAY_H
@@ -0,0 +1,161 @@
+#ifndef TRAFFIC_TRACE_H
+#define TRAFFIC_TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#ifdef ARDUINO
+#include "Arduino.h"
+#include <atomic>
+#include <esp_timer.h>
+#include "mem_pools.h"
+#endif
+
+/**
+ * @brief Kinds of events captured at the WebSocket and BLE boundaries.
+ */
+enum TraceEventType : uint8_t {
+    TRACE_WS_FRAME = 0,     ///< Text frame received from a WebSocket client
+    TRACE_BLE_CONNECT,      ///< Peripheral connected
+    TRACE_BLE_DISCONNECT,   ///< Peripheral disconnected
+    TRACE_BLE_NOTIFY,       ///< Voltage notification received
+    TRACE_STATUS,           ///< Status message published to clients
+    TRACE_STATE,            ///< Control value when the recording started: "<field> <value>"
+    TRACE_EVENT_TYPE_COUNT
+};
+
+static const char* const traceEventNames[TRACE_EVENT_TYPE_COUNT] = {
+    "ws", "connect", "disconnect", "notify", "status", "state"
+};
+
+/**
+ * @brief One recorded event.
+ */
+struct TraceEvent {
+    uint32_t timestampUs;  ///< Time since the recording started
+    uint8_t type;          ///< TraceEventType
+    int8_t device;         ///< Device index, -1 if not applicable
+    uint16_t seq;          ///< ws: number of the frame in the recording (from 1); status: number of the
+                           ///< frame whose command caused it, 0 if none (peripheral, schedule, peer)
+    uint8_t length;        ///< Number of valid bytes in data
+    char data[41];         ///< Payload, NUL-terminated
+};
+
+#ifdef ARDUINO
+
+/**
+ * @class TrafficRecorder
+ * @brief Records timestamped boundary events into a fixed buffer.
+ *
+ * record() is lock-free and may be called from several tasks; each call
+ * reserves its own slot. Recording stops by itself when the buffer is full.
+ * The buffer must only be read (events(), dump()) while not recording.
+ *
+ * Frames get a sequence number that the commands they produce carry to the
+ * BLE task, so each status message can be traced back to its frame. The
+ * numbers keep growing across recordings: a command still queued from an
+ * earlier recording does not match a frame of the current one.
+ */
+class TrafficRecorder {
+public:
+    /**
+     * @brief Allocate the event buffer.
+     * @param pool Pool to allocate from (PSRAM: a trace is large and not latency critical).
+     * @param maxEvents Number of events the buffer can hold.
+     * @return False if the buffer could not be allocated.
+     */
+    bool begin(MemPool& pool, size_t maxEvents) {
+        buffer = static_cast<TraceEvent*>(pool.allocate(maxEvents * sizeof(TraceEvent)));
+        capacity = buffer ? maxEvents : 0;
+        return buffer != nullptr;
+    }
+
+    /**
+     * @brief Discard the previous recording and start a new one.
+     */
+    void start() {
+        if (!buffer) return;
+        recording.store(false, std::memory_order_release);
+        seqBase.fetch_add(capacity, std::memory_order_relaxed);
+        reserved.store(0, std::memory_order_relaxed);
+        startUs = esp_timer_get_time();
+        recording.store(true, std::memory_order_release);
+    }
+
+    void stop() { recording.store(false, std::memory_order_release); }
+
+    bool isRecording() const { return recording.load(std::memory_order_acquire); }
+
+    /**
+     * @brief Record an event if a recording is running.
+     * @param type The event type.
+     * @param device The device index, or -1.
+     * @param data The payload (truncated to fit).
+     * @param length The payload length.
+     * @param causeSeq For a status: the sequence number of the command that caused it, 0 if none.
+     * @return For a frame: its sequence number, to be carried by its command; 0 if not recorded.
+     */
+    uint32_t record(TraceEventType type, int device, const char* data, size_t length, uint32_t causeSeq = 0) {
+        if (!isRecording()) return 0;
+        const uint32_t base = seqBase.load(std::memory_order_relaxed);
+        const size_t slot = reserved.fetch_add(1, std::memory_order_relaxed);
+        if (slot >= capacity) {
+            stop();
+            return 0;
+        }
+        TraceEvent& event = buffer[slot];
+        event.timestampUs = (uint32_t)(esp_timer_get_time() - startUs);
+        event.type = type;
+        event.device = (int8_t)device;
+        if (type == TRACE_WS_FRAME)     event.seq = (uint16_t)(slot + 1);
+        else if (causeSeq > base)       event.seq = (uint16_t)(causeSeq - base);  // Caused by a frame of this recording
+        else                            event.seq = 0;
+        event.length = (uint8_t)(length < sizeof(event.data) - 1 ? length : sizeof(event.data) - 1);
+        memcpy(event.data, data, event.length);
+        event.data[event.length] = '\0';
+        return type == TRACE_WS_FRAME ? base + (uint32_t)slot + 1 : 0;
+    }
+
+    uint32_t record(TraceEventType type, int device, const char* data = "", uint32_t causeSeq = 0) {
+        return record(type, device, data, strlen(data), causeSeq);
+    }
+
+    /**
+     * @brief Number of recorded events.
+     */
+    size_t size() const {
+        const size_t n = reserved.load(std::memory_order_acquire);
+        return n < capacity ? n : capacity;
+    }
+
+    /**
+     * @brief Recorded events, oldest first (only valid while not recording).
+     */
+    const TraceEvent* events() const { return buffer; }
+
+    /**
+     * @brief Print the recording, one event per line: "<us> <type> <device> <seq> <data>".
+     *
+     * The host replayer (test/test_replay) reads this format back.
+     */
+    void dump(Print& out) const {
+        out.printf("# trace %u events\n", (unsigned)size());
+        for (size_t i = 0; i < size(); ++i) {
+            const TraceEvent& event = buffer[i];
+            out.printf("%lu %s %d %u %s\n", (unsigned long)event.timestampUs,
+                       event.type < TRACE_EVENT_TYPE_COUNT ? traceEventNames[event.type] : "?", event.device,
+                       (unsigned)event.seq, event.data);
+        }
+    }
+
+private:
+    TraceEvent* buffer = nullptr;
+    size_t capacity = 0;
+    int64_t startUs = 0;
+    std::atomic<size_t> reserved{0};
+    std::atomic<uint32_t> seqBase{0};  ///< Sequence number before the first frame of this recording
+    std::atomic<bool> recording{false};
+};
+
+#endif // ARDUINO
+
+#endif // TRAFFIC_TRACE_H
@@ -0,0 +1,93 @@
+#ifndef VOLTAGE_CODEC_H
+#define VOLTAGE_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+// Voltage payloads on VOLTAGE_UUID come in two formats:
+//  - text (old firmware): ASCII volts, e.g. "12.34"
+//  - binary: 3 bytes, [0x80 | flags] [millivolts low] [millivolts high]
+// ASCII never sets bit 7, so the first byte tells the formats apart and
+// each peripheral can be upgraded independently.
+
+#define VOLTAGE_BINARY_MARKER 0x80
+#define VOLTAGE_BINARY_LENGTH 3
+#define VOLTAGE_FLAGS_MASK 0x7F
+
+/**
+ * @brief Wire format of a decoded voltage payload.
+ */
+enum VoltageFormat : uint8_t {
+    VOLTAGE_INVALID = 0,  ///< Payload could not be decoded
+    VOLTAGE_TEXT,         ///< ASCII volts
+    VOLTAGE_BINARY        ///< Fixed-point millivolts
+};
+
+/**
+ * @brief Parses ASCII volts ("12.34", "5", "3.3\n") into millivolts.
+ *
+ * Digits past the third decimal are ignored; leading and trailing whitespace is skipped.
+ *
+ * @return False if the text is not a plain non-negative decimal number or exceeds 65.535 V.
+ */
+inline bool parseMillivolts(const char* text, size_t length, uint16_t& millivolts) {
+    size_t i = 0;
+    while (i < length && (text[i] == ' ' || text[i] == '\t')) i++;
+    uint32_t whole = 0;
+    uint32_t fraction = 0;
+    uint32_t fractionDigits = 0;
+    bool digits = false;
+    for (; i < length && text[i] >= '0' && text[i] <= '9'; ++i) {
+        whole = whole * 10 + (uint32_t)(text[i] - '0');
+        if (whole > 65) return false;
+        digits = true;
+    }
+    if (i < length && text[i] == '.') {
+        for (++i; i < length && text[i] >= '0' && text[i] <= '9'; ++i) {
+            if (fractionDigits < 3) {
+                fraction = fraction * 10 + (uint32_t)(text[i] - '0');
+                fractionDigits++;
+            }
+            digits = true;
+        }
+    }
+    while (i < length && (text[i] == ' ' || text[i] == '\t' || text[i] == '\r' || text[i] == '\n' || text[i] == '\0')) i++;
+    if (!digits || i != length) return false;
+    while (fractionDigits++ < 3) fraction *= 10;
+    const uint32_t value = whole * 1000 + fraction;
+    if (value > 0xFFFF) return false;
+    millivolts = (uint16_t)value;
+    return true;
+}
+
+/**
+ * @brief Decodes a voltage payload in either format, without allocating.
+ *
+ * @param data The payload.
+ * @param length The payload length.
+ * @param millivolts Receives the voltage in millivolts.
+ * @param flags Receives the flags (always 0 for text payloads).
+ * @return The detected format, or VOLTAGE_INVALID.
+ */
+inline VoltageFormat decodeVoltage(const uint8_t* data, size_t length, uint16_t& millivolts, uint8_t& flags) {
+    if (length == 0) return VOLTAGE_INVALID;
+    if (data[0] & VOLTAGE_BINARY_MARKER) {
+        if (length != VOLTAGE_BINARY_LENGTH) return VOLTAGE_INVALID;
+        flags = data[0] & VOLTAGE_FLAGS_MASK;
+        millivolts = (uint16_t)(data[1] | (data[2] << 8));
+        return VOLTAGE_BINARY;
+    }
+    flags = 0;
+    return parseMillivolts(reinterpret_cast<const char*>(data), length, millivolts) ? VOLTAGE_TEXT : VOLTAGE_INVALID;
+}
+
+/**
+ * @brief Formats millivolts as volts with two decimals ("12.34").
+ * @return The number of characters written (excluding the NUL).
+ */
+inline int formatVolts(uint16_t millivolts, char* out, size_t size) {
+    return snprintf(out, size, "%u.%02u", (unsigned)(millivolts / 1000), (unsigned)((millivolts % 1000) / 10));
+}
+
+#endif // VOLTAGE_CODEC_H
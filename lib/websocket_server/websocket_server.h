@@ -15,19 +15,22 @@
  */
 void WiFiEvent(WiFiEvent_t event) {
     switch (event) {
-        case SYSTEM_EVENT_STA_CONNECTED:
+        case ARDUINO_EVENT_WIFI_STA_CONNECTED:
             Serial.println("WiFi Connected!");
             wifiConnected = true;
             break;
-        case SYSTEM_EVENT_STA_DISCONNECTED:
+        case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
             Serial.println("WiFi Disconnected!");
             wifiConnected = false;
+            wifiHasIp = false;
             // Red light when Wi-Fi is not connected
             pixels.setPixelColor(0, Adafruit_NeoPixel::Color(255, 0, 0)); // Red
             pixels.show();
             break;
-        case SYSTEM_EVENT_STA_GOT_IP:
+        case ARDUINO_EVENT_WIFI_STA_GOT_IP:
             wifiConnected = true;
+            wifiHasIp = true;
+            bootTimeline.mark(BOOT_WIFI_CONNECTED);
             Serial.print("WiFi Connected, IP: ");
             Serial.println(WiFi.localIP());
             // Turn off the LED when connected
@@ -35,6 +38,9 @@ void WiFiEvent(WiFiEvent_t event) {
             pixels.show();
             pixels.clear();
             break;
+        case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+            wifiHasIp = false;
+            break;
         default:
             break;
     }
@@ -45,6 +51,8 @@ void WiFiEvent(WiFiEvent_t event) {
  * @brief Class representing an ESP32 WebSocket server with BLE integration.
  */
 class ESP32WebSocketServer {
+    friend void benchWebSocketDispatch(ESP32WebSocketServer& server);  // lib/bench
+
 public:
     /**
      * @brief Constructor for the WebSocket server.
@@ -57,29 +65,47 @@ public:
 
     /**
      * @brief Initializes the WebSocket server, BLE client, and other components.
+     *
+     * Boot is staged so that nothing waits for Wi-Fi: association is started
+     * first and runs in the background while NVS, SPIFFS and BLE come up.
+     * mDNS, the federation socket and SNTP are started by the network task once
+     * the station has an IP address (see lanServicesJob).
      */
     void begin() {
         pixels.begin();
         pixels.clear();
         Serial.begin(115200);
-        WiFi.onEvent(WiFiEvent);
-        WiFi.begin(ssid, password);
-        while (WiFiClass::status() != WL_CONNECTED)
-        {
-            delay(500);
-            Serial.println("Connecting to WiFi...");
-        }
-
-#if USE_BLYNK == false
+        allocateBuffers();
 
-        Serial.println("Initializing WebSocket & BLE...");
-    
+        // NVS must be ready before the Wi-Fi driver reads its calibration data
         esp_err_t err = nvs_flash_init();
         if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
             ESP_ERROR_CHECK(nvs_flash_erase());
             err = nvs_flash_init();
         }
         ESP_ERROR_CHECK(err);
+        attachCommandPath();
+        bootTimeline.mark(BOOT_NVS_READY);
+
+        // Start association, don't wait for it
+        WiFi.onEvent(WiFiEvent);
+        WiFi.begin(ssid, password);
+        bootTimeline.mark(BOOT_WIFI_BEGIN);
+
+        // BLE runs on its own host task, so scanning proceeds while Wi-Fi associates
+        bleClient.onLinkChanged = onBleLinkChanged;
+        bleClient.connectFilter = federationAllowsConnect;
+        bleClient.runCommands = executeQueuedCommands;
+        federation.onRemoteCommand = onFederatedCommand;
+        federation.onRemoteDelta = onFederatedDelta;
+        federation.onForwardFailed = onForwardFailed;
+        bleClient.init();
+        bleClient.startScanning();
+        bootTimeline.mark(BOOT_BLE_SCANNING);
+
+#if USE_BLYNK == false
+
+        Serial.println("Initializing WebSocket & BLE...");
 
         if (!SPIFFS.begin(false))
         { // Try mounting first
@@ -88,11 +114,14 @@ public:
             SPIFFS.begin(true); // Try mounting again after format
         }
         else    Serial.println("SPIFFS mounted successfully!");
-    
+        bootTimeline.mark(BOOT_SPIFFS_READY);
+        cacheIndexHtml();
 
-        // Serve HTML from SPIFFS
-        server.on("/", HTTP_GET, [](AsyncWebServerRequest *request)    {
-            if (SPIFFS.exists("/index.html")) 
+        // Serve HTML from the PSRAM cache, or from SPIFFS if it could not be cached
+        server.on("/", HTTP_GET, [this](AsyncWebServerRequest *request)    {
+            if (indexHtml)
+                request->send_P(200, "text/html", indexHtml, indexHtmlLength);
+            else if (SPIFFS.exists("/index.html")) 
                 request->send(SPIFFS, "/index.html", "text/html");
             else 
             {
@@ -100,30 +129,31 @@ public:
                 request->send(404, "text/plain", "File Not Found");
             }
         });
-        // Set hostname
-        if (MDNS.begin("ac-control"))   Serial.println("mDNS responder started");
-        // Start Websocket
+        // State for integrations: GET /api/state, conditional (If-None-Match) or long-poll (?since=<version>&boot=<boot>)
+        server.on("/api/state", HTTP_GET, [this](AsyncWebServerRequest *request) {
+            this->handleStateRequest(request);
+        });
+        // Start Websocket; listeners bind to any address, so no IP is needed yet.
+        // Saved states are sent to each client on connect (see onWebSocketEvent).
         webSocket.begin();
         webSocket.onEvent([this](uint8_t num, WStype_t type, uint8_t* payload, size_t length) {
             this->onWebSocketEvent(num, type, payload, length);
         });
-        loadServerData(webSocket);
-        delay(1000);
         server.begin();
+        bootTimeline.mark(BOOT_SERVER_READY);
 #endif
-        bleClient.init();
-        bleClient.startScanning();
+        // Commands can be executed as soon as a peripheral connects
+        xTaskCreatePinnedToCore(bleTaskEntry, "ble", 8192, this, 2, nullptr, BLE_TASK_CORE);
     }
 
     /**
-     * @brief Main loop for handling WebSocket and BLE events.
+     * @brief Starts the network task (WebSocket/Blynk polling and command parsing).
+     *
+     * Called once the network side is configured (after Blynk.config() when Blynk is used;
+     * the network task connects to Blynk once the station has an IP address).
      */
-    void loop() {
-#if USE_BLYNK == false
-        webSocket.loop();
-#endif
-        ble_loop(webSocket);
-        delay(50);  // Required for ESP32 to run properly
+    void startNetworkTask() {
+        xTaskCreatePinnedToCore(networkTaskEntry, "net", 8192, this, 2, nullptr, NETWORK_TASK_CORE);
     }
 
 private:
@@ -131,181 +161,332 @@ private:
     const char* password;  // Wi-Fi password
     AsyncWebServer server;  // HTTP server
     WebSocketsServer webSocket;  // WebSocket server
+    bool mdnsStarted = false;  // mDNS is started once the station has an IP address
+    bool sntpStarted = false;  // SNTP is started once the station has an IP address
+    uint8_t* indexHtml = nullptr;  // index.html cached in assetPool
+    size_t indexHtmlLength = 0;
+
     /**
-     * @brief Toggles the state of a damper or AC based on WebSocket messages.
-     * 
-     * @param message The WebSocket message.
+     * @brief Serves the pre-serialized state document (async_tcp task).
+     *
+     * - the ETag is "<boot>-<version>"; If-None-Match with the current ETag gets 304;
+     * - ?since=<version>[&boot=<boot>] waits while the document is still that version of that
+     *   boot (up to LONG_POLL_TIMEOUT_MS), then sends the document; on timeout the current
+     *   document is sent, so clients compare "version" in the body and poll again. Any other
+     *   version or boot (e.g. `since` ahead of a gateway that rebooted) is answered at once.
+     * Requests only take a reference to the shared document, so they cost no serialization.
      */
-    void toggleButton(const String& message) {
-        NimBLEUUID CHARACTERISTIC_UUID = NimBLEUUID(STATE_UUID);
-
-        static bool damperStates[3] = {false};  // A
-        static bool acState = false;
-        if (message.startsWith("toggle_damper")) {
-            // Extract damper number from the message
-            int damperIndex = message.substring(13).toInt() - 1;  // Get damper number (e.g., "1" for damper1)
-    
-            if (damperIndex >= 0 && damperIndex < sizeof(damperStates) / sizeof(damperStates[0])) {
-                damperStates[damperIndex] = !damperStates[damperIndex];  // Toggle state
-                String newState = damperStates[damperIndex] ? "on" : "off";
-    
-                // Send update to the WebSocket clients
-                String statusMessage = "status_damper" + String(damperIndex + 1) + ":" + newState;
-                webSocket.broadcastTXT(statusMessage);
-                Serial.println(statusMessage.c_str());
-                NimBLEClient* pClient = bleClient.getClientForDamper(damperIndex+1);
-                if (!sendDataToPeripheral(CHARACTERISTIC_UUID, pClient, std::string(newState.c_str())))
-                { 
-                    bleClient.pendingCommands[damperIndex+1].characteristicUUID = CHARACTERISTIC_UUID;
-                    bleClient.pendingCommands[damperIndex+1].value = std::string(newState.c_str());
-                    bleClient.pendingCommands[damperIndex+1].pending = true;
-                    Serial.println("Command stored for later execution");
-                }
-                // Save last value to NVS
-                saveState("damper" + String(damperIndex + 1) + "_state", statusMessage);
-
-            }
+    void handleStateRequest(AsyncWebServerRequest* request) {
+        StateDocumentRef document = currentStateDocument();
+        if (!document)
+        {
+            request->send(503, "text/plain", "State not ready");
+            return;
         }
-        else if  (message.startsWith("toggle_ac"))
+        if (request->hasParam("since"))
         {
-            acState = !acState;
-            String newState = acState? "on" : "off";
-            // Send update to the WebSocket clients
-            String statusMessage = "status_ac:" + newState;
-            webSocket.broadcastTXT(statusMessage);
-            // Send to BLE Peripheral
-            if (!sendDataToPeripheral(CHARACTERISTIC_UUID, bleClient.getClientForDamper(0), std::string(newState.c_str())))
-            { 
-                bleClient.pendingCommands[0].characteristicUUID = CHARACTERISTIC_UUID;
-                bleClient.pendingCommands[0].value = std::string(newState.c_str());
-                bleClient.pendingCommands[0].pending = true;
-                Serial.println("Command stored for later execution");
+            const uint32_t since = strtoul(request->getParam("since")->value().c_str(), nullptr, 10);
+            const bool sameBoot = !request->hasParam("boot") ||
+                                  strtoul(request->getParam("boot")->value().c_str(), nullptr, 16) == document->boot;
+            if (sameBoot && since == document->version)
+            {
+                longPollState(request, since);
+                return;
             }
-            // Save last value to NVS
-            saveState("ac_state", statusMessage);
         }
-    
+        FixedString<24> etag;
+        etag.appendf("\"%08lx-%lu\"", (unsigned long)document->boot, (unsigned long)document->version);
+        AsyncWebServerResponse* response;
+        if (request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value() == etag.c_str())
+            response = request->beginResponse(304);
+        else
+            response = request->beginResponse("application/json", document->json.length(),
+                [document](uint8_t* buffer, size_t maxLength, size_t index) -> size_t {
+                    return copyDocument(*document, buffer, maxLength, index);
+                });
+        response->addHeader("ETag", etag.c_str());
+        response->addHeader("Cache-Control", "no-cache");
+        request->send(response);
     }
 
     /**
-     * @brief Sets the power level of a damper or AC based on WebSocket messages.
-     * 
-     * @param message The WebSocket message.
+     * @brief Answers a long-poll once the state version is no longer `since`, or on timeout.
+     *
+     * The chunked response's filler is polled by the TCP stack; it returns
+     * RESPONSE_TRY_AGAIN until there is something to send.
      */
-    void powerButton(const String& message) {
-        // Low, Medium, High, Auto
-        // Send message to WebSocket clients
-        // Dynamic approach using an array for damper states
-        NimBLEUUID CHARACTERISTIC_UUID = NimBLEUUID(VENT_SPEED_UUID);
-
-        if (message.startsWith("power_damper")) {
-            // Extract damper number from the message
-            int damperIndex = message.substring(12).toInt() - 1;  // Get damper number (e.g., "1" for damper1)
-            String power_state = message.substring(message.length() - 6);
-            // Send update to the WebSocket clients
-            String statusMessage = "power_damper" + String(damperIndex + 1) + ":" + power_state;
-            webSocket.broadcastTXT(statusMessage);
-            NimBLEClient* pClient = bleClient.getClientForDamper(damperIndex+1);
-            // sendDataToPeripheral(CHARACTERISTIC_UUID, pClient, std::string(power_state.c_str()));
-            if (!sendDataToPeripheral(CHARACTERISTIC_UUID, pClient, std::string(power_state.c_str())))
-            { 
-                bleClient.pendingCommands[damperIndex+1].characteristicUUID = CHARACTERISTIC_UUID;
-                bleClient.pendingCommands[damperIndex+1].value = std::string(power_state.c_str());
-                bleClient.pendingCommands[damperIndex+1].pending = true;
-                Serial.println("Command stored for later execution");
-            }
+    void longPollState(AsyncWebServerRequest* request, uint32_t since) {
+        const uint32_t deadline = millis() + LONG_POLL_TIMEOUT_MS;
+        StateDocumentRef chosen;
+        AsyncWebServerResponse* response = request->beginChunkedResponse("application/json",
+            [since, deadline, chosen](uint8_t* buffer, size_t maxLength, size_t index) mutable -> size_t {
+                if (!chosen)
+                {
+                    StateDocumentRef document = currentStateDocument();
+                    if (document->version == since && (int32_t)(millis() - deadline) < 0) return RESPONSE_TRY_AGAIN;
+                    chosen = document;
+                }
+                return copyDocument(*chosen, buffer, maxLength, index);
+            });
+        response->addHeader("Cache-Control", "no-cache");
+        request->send(response);
+    }
+
+    /**
+     * @brief Copies the next part of a state document into a response buffer.
+     * @return The number of bytes copied, 0 once the whole document was sent.
+     */
+    static size_t copyDocument(const StateDocument& document, uint8_t* buffer, size_t maxLength, size_t index) {
+        const size_t length = document.json.length();
+        if (index >= length) return 0;
+        const size_t count = length - index < maxLength ? length - index : maxLength;
+        memcpy(buffer, document.json.c_str() + index, count);
+        return count;
+    }
 
-            // Save last value to NVS
-            saveState("damper" + String(damperIndex + 1) + "_power", statusMessage);
+    /**
+     * @brief Loads index.html from SPIFFS into assetPool so requests don't hit flash.
+     */
+    void cacheIndexHtml() {
+        File file = SPIFFS.open("/index.html", "r");
+        if (!file) return;
+        const size_t size = file.size();
+        uint8_t* buffer = static_cast<uint8_t*>(assetPool.allocate(size));
+        if (buffer && file.read(buffer, size) == size) {
+            indexHtml = buffer;
+            indexHtmlLength = size;
+            Serial.printf("Cached index.html (%u bytes)\n", (unsigned)size);
         }
-        else if  (message.startsWith("power_ac"))
+        else    assetPool.release(buffer, size);
+        file.close();
+    }
+
+    /**
+     * @brief Task entry point for the BLE/command-execution task.
+     */
+    static void bleTaskEntry(void* arg) {
+        bleTaskStats.attachCurrentTask();
+        static_cast<ESP32WebSocketServer*>(arg)->bleTaskLoop();
+    }
+
+    /**
+     * @brief Task entry point for the network task.
+     */
+    static void networkTaskEntry(void* arg) {
+        networkTaskStats.attachCurrentTask();
+        static_cast<ESP32WebSocketServer*>(arg)->networkTaskLoop();
+    }
+
+    /**
+     * @brief Starts the services that need an IP address (network task timer job).
+     *
+     * Runs every LAN_SERVICES_RETRY_MS; does nothing until the station got an IP
+     * address, and retries a service that failed to start on the next run. The Blynk
+     * connection is (re)opened here with a bounded timeout, so an unreachable server
+     * delays the network task by at most BLYNK_CONNECT_TIMEOUT_MS per run.
+     */
+    static void lanServicesJob(void* arg) {
+        ESP32WebSocketServer* self = static_cast<ESP32WebSocketServer*>(arg);
+        if (!wifiHasIp) return;
+#if USE_BLYNK == false
+        if (!self->mdnsStarted)
+        {
+            self->mdnsStarted = MDNS.begin("ac-control");
+            Serial.println(self->mdnsStarted ? "mDNS responder started" : "mDNS start failed, retrying");
+        }
+#endif
+        if (!federation.isStarted())
         {
-            String power_state = message.substring(message.length() - 6);
-            // Send update to the WebSocket clients
-            String statusMessage = "power_ac: " + power_state;
-            webSocket.broadcastTXT(statusMessage);
-            // Send to BLE Peripheral
-            // sendDataToPeripheral(CHARACTERISTIC_UUID, bleClient.getClientForDamper(0), std::string(power_state.c_str()));
-            if (!sendDataToPeripheral(CHARACTERISTIC_UUID, bleClient.getClientForDamper(0), std::string(power_state.c_str())))
-            { 
-                bleClient.pendingCommands[0].characteristicUUID = CHARACTERISTIC_UUID;
-                bleClient.pendingCommands[0].value = std::string(power_state.c_str());
-                bleClient.pendingCommands[0].pending = true;
-                Serial.println("Command stored for later execution");
+            const bool listening = federation.begin(GATEWAY_ID);
+            Serial.printf("[fed] gateway %u %s on port %u\n", federation.id(), listening ? "listening" : "failed to listen, retrying",
+                          FEDERATION_PORT);
+        }
+        if (!self->sntpStarted)
+        {
+            configTzTime(TIMEZONE, NTP_SERVER);  // The clock keeps running if Wi-Fi drops later
+            self->sntpStarted = true;
+        }
+#if USE_BLYNK == true
+        if (!Blynk.connected() && !Blynk.connect(BLYNK_CONNECT_TIMEOUT_MS))
+            Serial.println("Blynk connect failed, retrying");
+#endif
+    }
+
+    /**
+     * @brief Executes queued commands and handles BLE connection and notification events.
+     *
+     * Wakes up as soon as a command is queued, otherwise every 20 ms. Connections are
+     * established asynchronously, so an attempt does not hold up the commands.
+     */
+    void bleTaskLoop() {
+        restoreDeviceStates();
+        startBleJobs();
+        for (;;) {
+            bleTaskStats.beginWork();
+            executeQueuedCommands();
+            ble_loop();
+            bleTaskStats.endWork();
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(20));
+        }
+    }
+
+    /**
+     * @brief Polls the WebSocket server (or Blynk) and publishes events from the BLE task.
+     */
+    void networkTaskLoop() {
+        startNetworkJobs();
+        networkTimers.schedule(LAN_SERVICES_RETRY_MS, lanServicesJob, this, LAN_SERVICES_RETRY_MS);
+        for (;;) {
+            networkTaskStats.beginWork();
+#if USE_BLYNK == true
+            if (Blynk.connected()) Blynk.run();  // Disconnected: lanServicesJob reconnects without blocking the loop
+#else
+            webSocket.loop();
+#endif
+            federation.poll();
+            GatewayEvent event;
+            while (eventQueue->pop(event))
+            {
+                federation.broadcastDelta(event.kind, event.device, event.field, event.text, event.millivolts,
+                                          event.originGateway, event.originSeq);
+                publishEvent(event, webSocket);
             }
-            
-            // Save last value to NVS
-            saveState("ac_power", statusMessage);
+            while (remoteEvents.pop(event))  publishEvent(event, webSocket);
+            networkTimers.advance(millis());  // LAN services, schedules and stats report
+            networkTaskStats.endWork();
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
         }
     }
 
     /**
-     * @brief Sets the AC mode (e.g., heat or cold) based on WebSocket messages.
-     * 
+     * @brief Handles the traffic recorder commands.
+     *
+     * - trace_start / trace_stop: start a new recording / stop it
+     * - trace_dump: print the recording to the serial console, to be replayed on the host (test/test_replay)
+     *
      * @param message The WebSocket message.
      */
-    void acMode(const String& message) { // Heat or cold
-        NimBLEUUID CHARACTERISTIC_UUID = NimBLEUUID(MODE_UUID);
-        String mode = message.substring(12);
-        String statusMessage = "ac_mode: " + mode;
-        webSocket.broadcastTXT(statusMessage);
-        // Send to BLE Peripheral
-        // sendDataToPeripheral(CHARACTERISTIC_UUID, bleClient.getClientForDamper(0), std::string(mode.c_str()));
-        if (!sendDataToPeripheral(CHARACTERISTIC_UUID, bleClient.getClientForDamper(0), std::string(mode.c_str())))
-        { 
-            bleClient.pendingCommands[0].characteristicUUID = CHARACTERISTIC_UUID;
-            bleClient.pendingCommands[0].value = std::string(mode.c_str());
-            bleClient.pendingCommands[0].pending = true;
-            Serial.println("Command stored for later execution");
+    void traceCommand(const char* message) {
+        if (strcmp(message, "trace_start") == 0)
+        {
+            trafficRecorder.start();
+            // Behind the commands already queued, ahead of the ones the recording will see
+            queueLocalCommand(CMD_TRACE_SNAPSHOT, -1, "");
+            Serial.println("[trace] recording");
+        }
+        else if (strcmp(message, "trace_stop") == 0)
+        {
+            trafficRecorder.stop();
+            Serial.printf("[trace] stopped, %u events\n", (unsigned)trafficRecorder.size());
+        }
+        else if (strcmp(message, "trace_dump") == 0)
+        {
+            if (!trafficRecorder.isRecording()) trafficRecorder.dump(Serial);
         }
-        // Save last value to NVS
-        saveState("ac_mode", statusMessage);
     }
 
     /**
-     * @brief Sets the AC temperature based on WebSocket messages.
-     * 
+     * @brief Handles the schedule commands and replies with the schedule table.
+     *
+     * - schedule_add:HH:MM <device> <field> <value>, e.g. "schedule_add:23:00 damper2 state off"
+     * - schedule_clear: remove every entry; schedule_clear:<index>: remove one entry
+     * - schedule_list: only reply
+     *
      * @param message The WebSocket message.
      */
-    void acTemp(const String& message) {
-        NimBLEUUID CHARACTERISTIC_UUID = NimBLEUUID(TEMP_UUID);
-        String temp = message.substring(12);
-        String statusMessage = "ac_temp: " + temp;
-        webSocket.broadcastTXT(statusMessage);
-        // Send to BLE Peripheral
-        // sendDataToPeripheral(CHARACTERISTIC_UUID, bleClient.getClientForDamper(0)/*bleClient.acClient*/, std::string(temp.c_str()));
-        if (!sendDataToPeripheral(CHARACTERISTIC_UUID, bleClient.getClientForDamper(0), std::string(temp.c_str())))
-        { 
-            bleClient.pendingCommands[0].characteristicUUID = CHARACTERISTIC_UUID;
-            bleClient.pendingCommands[0].value = std::string(temp.c_str());
-            bleClient.pendingCommands[0].pending = true;
-            Serial.println("Command stored for later execution");
+    void scheduleCommand(const char* message) {
+        if (startsWith(message, "schedule_add:"))
+        {
+            ScheduleEntry entry;
+            int slot = -1;
+            for (int i = 0; i < MAX_SCHEDULES && slot < 0; ++i)
+                if (!schedules[i].used) slot = i;
+            if (slot < 0 || !parseSchedule(message + 13, entry))
+            {
+                Serial.println(slot < 0 ? "[schedule] table full" : "[schedule] invalid entry");
+                return;
+            }
+            schedules[slot] = entry;
+            saveSchedules();
+        }
+        else if (strcmp(message, "schedule_clear") == 0)
+        {
+            memset(schedules, 0, sizeof(schedules));
+            saveSchedules();
+        }
+        else if (startsWith(message, "schedule_clear:"))
+        {
+            const int index = atoi(message + 15);
+            if (index < 0 || index >= MAX_SCHEDULES) return;
+            schedules[index].used = 0;
+            saveSchedules();
+        }
+        for (int i = 0; i < MAX_SCHEDULES; ++i) {
+            if (!schedules[i].used) continue;
+            FixedString<48> text;
+            formatSchedule(i, schedules[i], text);
+            Serial.println(text.c_str());
+            webSocket.broadcastTXT(text.c_str(), text.length());
         }
-        // Save last value to NVS
-        saveState("ac_temp", statusMessage);
     }
 
     /**
      * @brief Handles incoming WebSocket messages.
+     *
+     * Parses the payload in place (it is NUL-terminated by the WebSocket library),
+     * so handling a message does not allocate.
      * 
      * @param num The WebSocket client number.
      * @param payload The message payload.
      * @param length The length of the payload.
      */
     void handleWebSocketMessage(uint8_t num, uint8_t* payload, size_t length) {
-        String message = String((char*)payload);
-        Serial.println(message.c_str());
-        if (message.startsWith("toggle"))  // Check if message is a toggle message
-            toggleButton(message);
-        else if (message.startsWith("power"))  // Check if message is a power message
-            powerButton(message);
-        else if (message.startsWith("set_ac_mode"))
-            acMode(message);
-        else if (message.startsWith("set_ac_temp"))
-            acTemp(message);
+        const char* message = reinterpret_cast<const char*>(payload);
+        Serial.println(message);
+        if (startsWith(message, "trace_"))
+        {
+            traceCommand(message);
+            return;
+        }
+        if (startsWith(message, "schedule_"))
+        {
+            scheduleCommand(message);
+            return;
+        }
+        if (startsWith(message, "write_mode:"))  // "write_mode:acked" or "write_mode:pipelined"
+        {
+            const char* name = message + 11;
+            int mode = 0;
+            while (mode < WRITE_MODE_COUNT && strcmp(name, writeModeNames[mode]) != 0) mode++;
+            if (mode == WRITE_MODE_COUNT)
+                Serial.printf("Unknown write mode \"%s\", keeping %s\n", name, writeModeNames[writeMode.load()]);
+            else {
+                writeMode = (uint8_t)mode;
+                Serial.printf("Write mode: %s\n", writeModeNames[mode]);
+            }
+            return;
+        }
+        bootTimeline.mark(BOOT_FIRST_COMMAND);
+        const uint32_t traceSeq = trafficRecorder.record(TRACE_WS_FRAME, -1, message, length);
+        dispatchCommand(message, length, traceSeq);
+    }
+
+    /**
+     * @brief Parses a device command message and queues it for the BLE task.
+     *
+     * @param message The message, NUL-terminated.
+     * @param length The length of the message.
+     * @param traceSeq Sequence number of the recorded frame, 0 if not recorded.
+     */
+    void dispatchCommand(const char* message, size_t length, uint32_t traceSeq = 0) {
+        CommandKind kind;
+        int device;
+        const char* value;
+        if (parseCommand(message, length, kind, device, value))
+            queueCommand(kind, device, value, traceSeq);
         else
-            Serial.println("Unknown message received!");       
-    } 
+            Serial.println("Unknown message received!");
+    }
 
     /**
      * @brief Handles WebSocket events such as connection and message reception.
@@ -316,7 +497,11 @@ private:
      * @param length The length of the payload.
      */
     void onWebSocketEvent(uint8_t num, WStype_t type, uint8_t* payload, size_t length) {
-        if (type == WStype_CONNECTED)   loadServerData(webSocket);
+        if (type == WStype_CONNECTED)
+        {
+            loadServerData(webSocket);
+            queueCommand(CMD_WAKE, -1);  // Someone opened the UI: get the links ready for commands
+        }
         if (type == WStype_TEXT)   handleWebSocketMessage(num, payload, length);
 
     } 
@@ -1,21 +1,28 @@
 #include <websocket_server.h>
 #include <my_blynk.h>
+#ifdef RUN_BENCHMARKS
+#include <benchmarks.h>
+#endif
 
 ESP32WebSocketServer socket_server(ssid, pass);
 
 void setup() 
 {
+#ifdef RUN_BENCHMARKS
+  // Benchmark build: measure and report, without starting Wi-Fi or BLE
+  Serial.begin(115200);
+  runBenchmarks();
+#else
   socket_server.begin();
 #if USE_BLYNK == true
-  Blynk.begin(BLYNK_AUTH_TOKEN, ssid, pass);
+  Blynk.config(BLYNK_AUTH_TOKEN);  // Wi-Fi is already associating; the network task connects
+#endif
+  socket_server.startNetworkTask();
 #endif
 }
 
 void loop()
 {
-#if USE_BLYNK == true
-    Blynk.run();
-#endif
-    socket_server.loop();
-delay(50);  // Required for ESP32 to run properly
+  // All work runs in the pinned network and BLE tasks (see ESP32WebSocketServer)
+  vTaskDelete(nullptr);
 }
@@ -0,0 +1,196 @@
+// Host microbenchmarks of the pure parts of the command path: pio test -e native -f test_bench -v
+//
+// Parsing, status building, the RAM store, lookups, the voltage codec, the
+// snapshots and the timer wheel need neither radio nor flash, so they are
+// measured here and diffed between runs on a workstation. The radio- and
+// NVS-bound cases stay in the device's bench environment (lib/bench/benchmarks.h).
+// Every case also checks that it does not allocate.
+
+#include <unity.h>
+#include <cstdlib>
+#include <cstring>
+#include "bench.h"
+#include "command_path.h"
+#include "spsc_queue.h"
+#include "timer_wheel.h"
+#include "voltage_codec.h"
+
+#define BENCH_TIMERS 4096
+#define BENCH_RESIDENT_TIMERS 4000
+
+static volatile uint32_t sink;  ///< Keeps results alive so the bodies are not optimised away
+
+void setUp() {
+    static RamStateStore ramStore;
+    stateStore = &ramStore;
+    controlLink = nullptr;
+    onControlStatus = nullptr;
+}
+
+void tearDown() {}
+
+void test_bench_dispatch() {
+    static const char* const messages[] = {
+        "toggle_damper2", "power_damper1_p_high", "set_ac_mode:heat", "set_ac_temp:24", "toggle_ac", "power_ac_p_auto"
+    };
+    static SpscQueue<GatewayCommand, 16> queue;
+    const BenchResult result = runBenchmark("dispatch websocket command", 200000, [](uint32_t i) {
+        const char* message = messages[i % 6];
+        GatewayCommand command;
+        int device;
+        const char* value;
+        if (!parseCommand(message, strlen(message), command.kind, device, value)) return;
+        command.device = (int8_t)device;
+        copyString(command.value, value, sizeof(command.value));
+        command.enqueuedUs = commandClockUs();
+        queue.push(command);
+        while (queue.pop(command)) sink = command.kind;
+    });
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, result.allocsPerOp);
+}
+
+void test_bench_build_status() {
+    static const int8_t pairs[][2] = {{0, CONTROL_STATE}, {0, CONTROL_MODE}, {0, CONTROL_TEMP}, {2, CONTROL_STATE}, {3, CONTROL_POWER}};
+    const BenchResult result = runBenchmark("buildStatus", 500000, [](uint32_t i) {
+        FixedString<40> statusMessage;
+        FixedString<16> key;
+        buildStatus(pairs[i % 5][0], pairs[i % 5][1], "p_high", statusMessage, key);
+        sink = (uint32_t)statusMessage.length();
+    });
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, result.allocsPerOp);
+}
+
+void test_bench_ram_store() {
+    static const char* const keys[] = {"damper1_state", "damper2_power", "ac_mode", "ac_temp"};
+    const BenchResult save = runBenchmark("saveState (ram store)", 500000, [](uint32_t i) {
+        saveState(keys[i % 4], "status_damper2:on");
+    });
+    const BenchResult load = runBenchmark("loadState (ram store)", 500000, [](uint32_t i) {
+        char value[48];
+        sink = loadState(keys[i % 4], value, sizeof(value));
+    });
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, save.allocsPerOp);
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, load.allocsPerOp);
+}
+
+void test_bench_lookups() {
+    static const std::vector<std::string> targets = {AC_MAC, PARENTS_ROOM_DUMPER_MAC, WORKING_ROOM_DUMPER_MAC,
+                                                     SAFE_ROOM_DUMPER_MAC, TEST1_MAC, TEST2_MAC};
+    static const std::string target(TEST2_MAC);  // Last in the list
+    static const std::string other("11:22:33:44:55:66");
+    static const std::string noName;
+    static const std::string parents(PARENTS_ROOM_DUMPER_MAC);
+    const BenchResult hit = runBenchmark("isTargetIdentifier (hit, last)", 200000, [](uint32_t) {
+        sink = isTargetIdentifier(targets, target, noName);
+    });
+    const BenchResult miss = runBenchmark("isTargetIdentifier (miss)", 200000, [](uint32_t) {
+        sink = isTargetIdentifier(targets, other, noName);
+    });
+    const BenchResult index = runBenchmark("deviceIndexOfMac", 200000, [](uint32_t) {
+        sink = (uint32_t)deviceIndexOfMac(parents);
+    });
+    runBenchmark("deviceNameOfMac", 200000, [](uint32_t) {  // Returns a std::string: allocates for long names
+        sink = (uint32_t)deviceNameOfMac(parents).size();
+    });
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, hit.allocsPerOp);
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, miss.allocsPerOp);
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, index.allocsPerOp);
+}
+
+void test_bench_voltage_codec() {
+    static const uint8_t text[] = {'1', '2', '.', '3', '4'};
+    static const uint8_t binary[] = {VOLTAGE_BINARY_MARKER, 0x34, 0x30};  // 12.34 V
+    const BenchResult fromText = runBenchmark("decodeVoltage (text)", 500000, [](uint32_t) {
+        uint16_t millivolts = 0;
+        uint8_t flags;
+        decodeVoltage(text, sizeof(text), millivolts, flags);
+        sink = millivolts;
+    });
+    const BenchResult fromBinary = runBenchmark("decodeVoltage (binary)", 500000, [](uint32_t) {
+        uint16_t millivolts = 0;
+        uint8_t flags;
+        decodeVoltage(binary, sizeof(binary), millivolts, flags);
+        sink = millivolts;
+    });
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, fromText.allocsPerOp);
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, fromBinary.allocsPerOp);
+}
+
+void test_bench_snapshot() {
+    for (int device = 0; device < MAX_CLIENTS; ++device)
+        for (int field = 0; field < CONTROL_COUNT; ++field)
+            copyString(deviceState[device][field], field == CONTROL_STATE ? "on" : "p_high", CONTROL_VALUE_SIZE);
+    const BenchResult messages = runBenchmark("state snapshot to status messages", 100000, [](uint32_t) {
+        FixedString<512> snapshot;
+        for (int device = 0; device < MAX_CLIENTS; ++device)
+            for (int field = 0; field < CONTROL_COUNT; ++field) {
+                if (!deviceHasField(device, field)) continue;
+                FixedString<40> statusMessage;
+                FixedString<16> key;
+                buildStatus(device, field, deviceState[device][field], statusMessage, key);
+                snapshot.append(statusMessage.c_str()).append("\n");
+            }
+        sink = (uint32_t)snapshot.length();
+    });
+    static const bool connected[MAX_CLIENTS] = {true, true, false, true};
+    static const int32_t millivolts[MAX_CLIENTS] = {12340, 3710, -1, 3690};
+    const BenchResult document = runBenchmark("state document to json", 100000, [](uint32_t i) {
+        static FixedString<1024> json;  // The size of the gateway's state documents
+        json.clear();
+        serializeStateDocument(json, 0x5c3a01f2, i, connected, millivolts);
+        sink = (uint32_t)json.length();
+    });
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, messages.allocsPerOp);
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, document.allocsPerOp);
+}
+
+static uint32_t timerRuns = 0;
+
+static void countTimerRun(void*) { timerRuns++; }
+
+void test_bench_timer_wheel() {
+    static TimerWheel<BENCH_TIMERS> wheel;
+    uint32_t now = 0;
+    wheel.begin(now);
+    // One-shot timers spread over 1 s .. 10 min, so every wheel level is populated
+    srand(1);
+    for (uint32_t i = 0; i < BENCH_RESIDENT_TIMERS; ++i)
+        wheel.schedule(1000 + (uint32_t)rand() % 600000, countTimerRun);
+
+    const BenchResult schedule = runBenchmark("timer schedule+cancel (4000 live)", 200000, [](uint32_t i) {
+        wheel.cancel(wheel.schedule(10 + (i * 7919) % 600000, countTimerRun));
+    });
+    const BenchResult oneShot = runBenchmark("timer advance tick (4000 one-shot)", 60100, [&now](uint32_t) {
+        now += TIMER_TICK_MS;
+        wheel.advance(now);
+    });
+    printf("[bench] timer one-shot callbacks %lu, left %u\n", (unsigned long)timerRuns, (unsigned)wheel.size());
+    TEST_ASSERT_EQUAL(BENCH_RESIDENT_TIMERS, (int)timerRuns);
+
+    // Periodic load: every timer runs once a second, ~40 callbacks per tick
+    timerRuns = 0;
+    for (uint32_t i = 0; i < BENCH_RESIDENT_TIMERS; ++i)
+        wheel.schedule(10 + i % 1000, countTimerRun, nullptr, 1000);
+    const BenchResult periodic = runBenchmark("timer advance tick (4000 periodic)", 10000, [&now](uint32_t) {
+        now += TIMER_TICK_MS;
+        wheel.advance(now);
+    });
+    printf("[bench] timer periodic callbacks %lu, peak %u/%u timers, pool failures %lu\n", (unsigned long)timerRuns,
+           (unsigned)wheel.peak(), (unsigned)wheel.capacity(), (unsigned long)wheel.poolFailures());
+    TEST_ASSERT_EQUAL(0, (int)wheel.poolFailures());
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, schedule.allocsPerOp);
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, oneShot.allocsPerOp);
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, periodic.allocsPerOp);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_bench_dispatch);
+    RUN_TEST(test_bench_build_status);
+    RUN_TEST(test_bench_ram_store);
+    RUN_TEST(test_bench_lookups);
+    RUN_TEST(test_bench_voltage_codec);
+    RUN_TEST(test_bench_snapshot);
+    RUN_TEST(test_bench_timer_wheel);
+    return UNITY_END();
+}
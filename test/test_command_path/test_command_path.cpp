@@ -0,0 +1,212 @@
+// Host tests of the command path: pio test -e native
+//
+// executeCommand runs against a RAM store and a fake link that stands in for
+// the peripherals, so every write mode and connection state can be exercised.
+
+#include <unity.h>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "command_path.h"
+
+// Every operator new/delete of the test binary is counted, so the soak can
+// check that the command path leaves no heap allocation behind.
+static std::atomic<long> allocations{0};
+static std::atomic<long> frees{0};
+
+void* operator new(size_t size) {
+    allocations++;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept {
+    if (p) frees++;
+    std::free(p);
+}
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t) noexcept { operator delete(p); }
+
+/**
+ * @brief Peripherals in memory: a connected device stores what is written and reads it back.
+ */
+class FakeControlLink : public ControlLink {
+public:
+    bool connected[MAX_CLIENTS] = {};
+    bool dropPipelined = false;  ///< Lose every write without response, so the confirming read disagrees
+    char values[MAX_CLIENTS][CONTROL_COUNT][CONTROL_VALUE_SIZE] = {};
+    unsigned ackedWrites = 0;
+    unsigned pipelinedWrites = 0;
+    unsigned reads = 0;
+
+    LinkProfile markActivity(int) override { return LINK_LOW_LATENCY; }
+
+    bool write(int device, int field, const char* value, WriteMode& mode) override {
+        if (!connected[device]) return false;
+        if (mode == WRITE_PIPELINED) {
+            pipelinedWrites++;
+            if (dropPipelined) return true;
+        }
+        else ackedWrites++;
+        copyString(values[device][field], value, CONTROL_VALUE_SIZE);
+        return true;
+    }
+
+    bool read(int device, int field, char* value, size_t size) override {
+        value[0] = '\0';
+        if (!connected[device]) return false;
+        reads++;
+        return copyString(value, values[device][field], size) < size;
+    }
+};
+
+static FakeControlLink link;
+static RamStateStore* store = nullptr;
+static unsigned statusCount = 0;
+static char lastStatus[40];
+static const GatewayCommand* lastCause = nullptr;
+
+static void recordStatus(int, int, const char* statusMessage, const GatewayCommand* cause) {
+    statusCount++;
+    copyString(lastStatus, statusMessage, sizeof(lastStatus));
+    lastCause = cause;
+}
+
+static GatewayCommand makeCommand(CommandKind kind, int device, const char* value = "") {
+    GatewayCommand command;
+    command.kind = kind;
+    command.device = (int8_t)device;
+    copyString(command.value, value, sizeof(command.value));
+    command.enqueuedUs = commandClockUs();
+    command.originGateway = FEDERATION_NO_OWNER;
+    command.originSeq = 0;
+    command.traceSeq = 0;
+    return command;
+}
+
+void setUp() {
+    link = FakeControlLink();
+    delete store;
+    store = new RamStateStore();
+    stateStore = store;
+    controlLink = &link;
+    onControlStatus = recordStatus;
+    memset(deviceState, 0, sizeof(deviceState));
+    memset(pendingFields, 0, sizeof(pendingFields));
+    memset(writeBatches, 0, sizeof(writeBatches));
+    writeMode = WRITE_ACKED;
+    pipelineFallbacks = 0;
+    for (LatencyStats& stats : commandWriteLatency) stats.reset();
+    statusCount = 0;
+    lastStatus[0] = '\0';
+}
+
+void tearDown() {}
+
+void test_toggle_writes_publishes_and_saves() {
+    link.connected[2] = true;
+    executeCommand(makeCommand(CMD_TOGGLE, 2));
+    TEST_ASSERT_EQUAL_STRING("on", deviceState[2][CONTROL_STATE]);
+    TEST_ASSERT_EQUAL_STRING("on", link.values[2][CONTROL_STATE]);
+    TEST_ASSERT_EQUAL(1, (int)statusCount);
+    TEST_ASSERT_EQUAL_STRING("status_damper2:on", lastStatus);
+    char saved[48];
+    TEST_ASSERT_TRUE(loadState("damper2_state", saved, sizeof(saved)));
+    TEST_ASSERT_EQUAL_STRING("status_damper2:on", saved);
+
+    executeCommand(makeCommand(CMD_TOGGLE, 2));
+    TEST_ASSERT_EQUAL_STRING("off", link.values[2][CONTROL_STATE]);
+    TEST_ASSERT_EQUAL(0, (int)pendingFields[2]);
+    TEST_ASSERT_EQUAL(2, (int)link.ackedWrites);
+}
+
+void test_disconnected_device_keeps_the_command_pending() {
+    executeCommand(makeCommand(CMD_POWER, 1, "p_high"));
+    TEST_ASSERT_EQUAL_STRING("p_high", deviceState[1][CONTROL_POWER]);
+    TEST_ASSERT_EQUAL(1 << CONTROL_POWER, (int)pendingFields[1]);
+    TEST_ASSERT_EQUAL(1, (int)statusCount);
+
+    // AC-only fields are ignored on dampers
+    executeCommand(makeCommand(CMD_MODE, 1, "heat"));
+    TEST_ASSERT_EQUAL(1, (int)statusCount);
+    TEST_ASSERT_EQUAL_STRING("", deviceState[1][CONTROL_MODE]);
+}
+
+void test_pipelined_batch_is_confirmed_by_one_read() {
+    writeMode = WRITE_PIPELINED;
+    link.connected[0] = true;
+    executeCommand(makeCommand(CMD_MODE, 0, "heat"));
+    executeCommand(makeCommand(CMD_TEMP, 0, "24"));
+    executeCommand(makeCommand(CMD_POWER, 0, "p_auto"));
+    TEST_ASSERT_EQUAL(3, (int)link.pipelinedWrites);
+    TEST_ASSERT_EQUAL(0, (int)link.reads);
+
+    confirmPipelinedWrites();
+    TEST_ASSERT_EQUAL(1, (int)link.reads);
+    TEST_ASSERT_EQUAL(0, (int)pipelineFallbacks.load());
+    TEST_ASSERT_EQUAL_UINT32(3, commandWriteLatency[WRITE_PIPELINED].count());
+    TEST_ASSERT_EQUAL_UINT32(0, commandWriteLatency[WRITE_ACKED].count());
+
+    confirmPipelinedWrites();  // Nothing left to confirm
+    TEST_ASSERT_EQUAL(1, (int)link.reads);
+}
+
+void test_mismatched_read_back_resends_acked() {
+    writeMode = WRITE_PIPELINED;
+    link.connected[3] = true;
+    link.dropPipelined = true;
+    executeCommand(makeCommand(CMD_SET_STATE, 3, "on"));
+    executeCommand(makeCommand(CMD_POWER, 3, "p_low"));
+    confirmPipelinedWrites();
+    TEST_ASSERT_EQUAL(1, (int)pipelineFallbacks.load());
+    TEST_ASSERT_EQUAL(2, (int)link.ackedWrites);
+    TEST_ASSERT_EQUAL_STRING("on", link.values[3][CONTROL_STATE]);
+    TEST_ASSERT_EQUAL_STRING("p_low", link.values[3][CONTROL_POWER]);
+    TEST_ASSERT_EQUAL_UINT32(0, commandWriteLatency[WRITE_PIPELINED].count());
+    TEST_ASSERT_EQUAL_UINT32(2, commandWriteLatency[WRITE_ACKED].count());
+
+    // Gone before the re-send: the values stay pending for reconciliation
+    link.connected[3] = false;
+    executeCommand(makeCommand(CMD_POWER, 3, "p_high"));
+    TEST_ASSERT_EQUAL(1 << CONTROL_POWER, (int)pendingFields[3]);
+}
+
+/**
+ * @brief Executes one command of the soak mix; confirms the pipelined batches every third command.
+ */
+static void soakCommand(uint32_t i) {
+    static const CommandKind kinds[] = {CMD_TOGGLE, CMD_POWER, CMD_MODE, CMD_TEMP, CMD_SET_STATE, CMD_TOGGLE, CMD_WAKE};
+    static const char* const values[] = {"", "p_high", "heat", "24", "off", "", ""};
+    const CommandKind kind = kinds[i % 7];
+    writeMode = (i / 7) % 2 ? WRITE_PIPELINED : WRITE_ACKED;
+    link.dropPipelined = i % 11 == 0;  // Now and then a batch is re-sent acked
+    executeCommand(makeCommand(kind, kind == CMD_MODE || kind == CMD_TEMP ? 0 : (int)(i % MAX_CLIENTS), values[i % 7]));
+    if (i % 3 == 2) confirmPipelinedWrites();
+}
+
+void test_soak_leaves_no_heap_allocation() {
+    link.connected[0] = link.connected[1] = link.connected[2] = true;  // Device 3 stays away: pending path
+    for (uint32_t i = 0; i < 42; ++i) soakCommand(i);  // First store entries and batches
+    const long allocationsBefore = allocations.load();
+    const long freesBefore = frees.load();
+    for (uint32_t i = 0; i < 20000; ++i) soakCommand(i);
+    confirmPipelinedWrites();
+    const long allocated = allocations.load() - allocationsBefore;
+    const long net = allocated - (frees.load() - freesBefore);
+    TEST_ASSERT_EQUAL(0, net);
+    TEST_ASSERT_EQUAL(0, allocated);
+    TEST_ASSERT_TRUE(link.ackedWrites > 0 && link.pipelinedWrites > 0 && link.reads > 0);
+    TEST_ASSERT_TRUE(pipelineFallbacks.load() > 0);
+    TEST_ASSERT_TRUE(pendingFields[3] != 0);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_toggle_writes_publishes_and_saves);
+    RUN_TEST(test_disconnected_device_keeps_the_command_pending);
+    RUN_TEST(test_pipelined_batch_is_confirmed_by_one_read);
+    RUN_TEST(test_mismatched_read_back_resends_acked);
+    RUN_TEST(test_soak_leaves_no_heap_allocation);
+    return UNITY_END();
+}
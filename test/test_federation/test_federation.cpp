@@ -0,0 +1,350 @@
+// Host tests of the gateway federation: pio test -e native
+//
+// Three gateways run the real protocol over an in-memory network and a manual clock.
+
+#include <unity.h>
+#include <deque>
+#include <vector>
+#include "federation.h"
+
+/**
+ * @brief Datagrams between the in-memory transports; a broadcast also reaches its sender, like UDP.
+ */
+struct LoopbackNetwork;
+
+class LoopbackTransport : public FederationTransport {
+public:
+    LoopbackTransport(LoopbackNetwork& network, uint32_t address) : network(network), address(address) {}
+
+    bool open(uint16_t) override {
+        listening = true;
+        return true;
+    }
+    bool send(uint32_t to, const void* packet, size_t size) override;
+    size_t receive(void* buffer, size_t size, uint32_t& from) override {
+        if (inbox.empty()) return 0;
+        const Datagram& datagram = inbox.front();
+        const size_t length = datagram.bytes.size() < size ? datagram.bytes.size() : size;
+        memcpy(buffer, datagram.bytes.data(), length);
+        from = datagram.from;
+        inbox.pop_front();
+        return length;
+    }
+
+    /**
+     * @brief Stop sending and receiving, like a gateway that lost power.
+     */
+    void close() {
+        listening = false;
+        inbox.clear();
+    }
+
+    struct Datagram {
+        uint32_t from;
+        std::vector<uint8_t> bytes;
+    };
+
+    LoopbackNetwork& network;
+    const uint32_t address;
+    bool listening = false;
+    std::deque<Datagram> inbox;
+};
+
+struct LoopbackNetwork {
+    std::vector<LoopbackTransport*> endpoints;
+    int lose[FED_ACK + 1] = {};  ///< Datagrams of each FederationMessageType still to be lost
+
+    void deliver(uint32_t from, uint32_t to, const void* packet, size_t size) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(packet);
+        const uint8_t type = static_cast<const FederationHeader*>(packet)->type;
+        if (type <= FED_ACK && lose[type] > 0) {
+            lose[type]--;
+            return;
+        }
+        for (LoopbackTransport* endpoint : endpoints)
+            if (endpoint->listening && (to == FEDERATION_BROADCAST || to == endpoint->address))
+                endpoint->inbox.push_back({from, std::vector<uint8_t>(bytes, bytes + size)});
+    }
+};
+
+bool LoopbackTransport::send(uint32_t to, const void* packet, size_t size) {
+    if (!listening) return false;
+    network.deliver(address, to, packet, size);
+    return true;
+}
+
+/**
+ * @brief One clock shared by every gateway, advanced by the test.
+ */
+class ManualClock : public FederationClock {
+public:
+    uint32_t nowMs() override { return ms; }
+    int64_t nowUs() override { return (int64_t)ms * 1000; }
+    uint32_t ms = 1;
+};
+
+struct Received {
+    uint8_t gateway;
+    uint8_t from;
+    uint16_t seq;
+    uint8_t kind;
+    int device;
+    char text[40];
+};
+static std::vector<Received> commands;
+static std::vector<Received> deltas;
+static std::vector<Received> failedForwards;
+
+template <uint8_t Gateway>
+bool recordCommand(const FederationCommand& command) {
+    Received received = {Gateway, command.header.gatewayId, command.header.seq, command.kind, command.device, {0}};
+    strncpy(received.text, command.value, sizeof(received.text) - 1);
+    commands.push_back(received);
+    return true;
+}
+
+template <uint8_t Gateway>
+void recordFailedForward(const FederationCommand& command) {
+    Received received = {Gateway, command.header.gatewayId, command.header.seq, command.kind, command.device, {0}};
+    strncpy(received.text, command.value, sizeof(received.text) - 1);
+    failedForwards.push_back(received);
+}
+
+template <uint8_t Gateway>
+void recordDelta(const FederationDelta& delta) {
+    Received received = {Gateway, delta.header.gatewayId, delta.header.seq, delta.eventKind, delta.device, {0}};
+    strncpy(received.text, delta.text, sizeof(received.text) - 1);
+    deltas.push_back(received);
+}
+
+struct Gateway {
+    Gateway(LoopbackNetwork& network, ManualClock& clock, uint8_t id)
+        : transport(network, 0x0A000000u | id), federation(transport, clock) {
+        network.endpoints.push_back(&transport);
+        TEST_ASSERT_TRUE(federation.begin(id));
+    }
+    LoopbackTransport transport;
+    GatewayFederation federation;
+};
+
+/**
+ * @brief Gateways 1, 2 and 3 on one network.
+ */
+struct Lan {
+    LoopbackNetwork network;
+    ManualClock clock;
+    Gateway gateways[3] = {{network, clock, 1}, {network, clock, 2}, {network, clock, 3}};
+
+    Lan() {
+        commands.clear();
+        deltas.clear();
+        failedForwards.clear();
+        gateway(1).onRemoteCommand = recordCommand<1>;
+        gateway(2).onRemoteCommand = recordCommand<2>;
+        gateway(3).onRemoteCommand = recordCommand<3>;
+        gateway(1).onRemoteDelta = recordDelta<1>;
+        gateway(2).onRemoteDelta = recordDelta<2>;
+        gateway(3).onRemoteDelta = recordDelta<3>;
+        gateway(1).onForwardFailed = recordFailedForward<1>;
+    }
+
+    GatewayFederation& gateway(uint8_t id) { return gateways[id - 1].federation; }
+
+    /**
+     * @brief Advance the clock in 50 ms steps, polling every gateway after each step.
+     */
+    void run(uint32_t ms) {
+        for (uint32_t elapsed = 0; elapsed < ms; elapsed += 50) {
+            clock.ms += 50;
+            for (Gateway& g : gateways) g.federation.poll();
+        }
+    }
+
+    void assertOwner(int device, uint8_t owner) {
+        for (Gateway& g : gateways) TEST_ASSERT_EQUAL_UINT8(owner, g.federation.ownerOf(device));
+    }
+};
+
+void setUp() {}
+void tearDown() {}
+
+void test_best_rssi_owns_the_device() {
+    Lan lan;
+    lan.run(3000);
+    lan.assertOwner(0, FEDERATION_NO_OWNER);  // Nobody has heard it yet
+
+    lan.gateway(1).observeLocal(0, -80, false);
+    lan.gateway(2).observeLocal(0, -60, false);
+    lan.gateway(3).observeLocal(0, -70, false);
+    lan.gateway(3).observeLocal(1, -75, false);
+    lan.run(3000);
+    lan.assertOwner(0, 2);
+    lan.assertOwner(1, 3);
+    TEST_ASSERT_TRUE(lan.gateway(2).mayConnect(0));
+    TEST_ASSERT_FALSE(lan.gateway(1).mayConnect(0));
+}
+
+void test_connected_device_moves_only_past_the_margin() {
+    Lan lan;
+    lan.gateway(1).observeLocal(0, -70, true);
+    lan.run(3000);
+    lan.assertOwner(0, 1);
+
+    // 5 dB better is within the hysteresis: the connection stays
+    lan.gateway(2).observeLocal(0, -65, false);
+    lan.run(3000);
+    lan.assertOwner(0, 1);
+
+    // 9 dB better takes the device over
+    lan.gateway(2).observeLocal(0, -61, false);
+    lan.run(3000);
+    lan.assertOwner(0, 2);
+    TEST_ASSERT_FALSE(lan.gateway(1).mayConnect(0));
+
+    // The old holder drops the link, the new owner connects and completes the handover
+    lan.gateway(1).onLocalDisconnected(0);
+    TEST_ASSERT_EQUAL_UINT32(0, lan.gateway(2).handoverLatency.count());
+    lan.gateway(2).onLocalConnected(0);
+    TEST_ASSERT_EQUAL_UINT32(1, lan.gateway(2).handoverLatency.count());
+    lan.run(3000);
+    lan.assertOwner(0, 2);
+}
+
+void test_silent_holder_loses_the_device() {
+    Lan lan;
+    lan.gateway(1).observeLocal(0, -70, true);
+    lan.gateway(3).observeLocal(0, -75, false);
+    lan.run(3000);
+    lan.assertOwner(0, 1);
+
+    lan.gateways[0].transport.close();
+    lan.run(FEDERATION_PEER_TIMEOUT_MS + 2 * FEDERATION_HEARTBEAT_MS);
+    TEST_ASSERT_EQUAL_UINT8(3, lan.gateway(2).ownerOf(0));
+    TEST_ASSERT_EQUAL_UINT8(3, lan.gateway(3).ownerOf(0));
+}
+
+void test_command_is_forwarded_to_the_owner() {
+    Lan lan;
+    lan.gateway(1).observeLocal(0, -80, false);
+    lan.gateway(3).observeLocal(0, -60, true);
+    lan.run(3000);
+    lan.assertOwner(0, 3);
+
+    TEST_ASSERT_TRUE(lan.gateway(1).forwardCommand(7, 0, "heat"));
+    lan.run(100);
+    TEST_ASSERT_EQUAL(1, (int)commands.size());
+    TEST_ASSERT_EQUAL_UINT8(3, commands[0].gateway);
+    TEST_ASSERT_EQUAL_UINT8(1, commands[0].from);
+    TEST_ASSERT_EQUAL_UINT8(7, commands[0].kind);
+    TEST_ASSERT_EQUAL(0, commands[0].device);
+    TEST_ASSERT_EQUAL_STRING("heat", commands[0].text);
+    TEST_ASSERT_EQUAL_UINT32(1, lan.gateway(1).forwardedCount());
+    TEST_ASSERT_EQUAL_UINT32(1, lan.gateway(3).receivedCount());
+    lan.run(1000);
+    TEST_ASSERT_EQUAL_UINT32(0, lan.gateway(1).retryCount());  // Acknowledged
+    TEST_ASSERT_EQUAL(1, (int)commands.size());
+
+    // The owner executes its own commands; nobody owns device 5
+    TEST_ASSERT_FALSE(lan.gateway(3).forwardCommand(7, 0, "cool"));
+    TEST_ASSERT_FALSE(lan.gateway(1).forwardCommand(7, 5, "on"));
+    lan.run(100);
+    TEST_ASSERT_EQUAL(1, (int)commands.size());
+}
+
+void test_delta_reaches_every_peer() {
+    Lan lan;
+    lan.gateway(1).observeLocal(0, -80, false);
+    lan.gateway(3).observeLocal(0, -60, true);
+    lan.run(3000);
+
+    // The owner answers gateway 1's forwarded command with a delta
+    TEST_ASSERT_TRUE(lan.gateway(1).forwardCommand(7, 0, "heat"));
+    lan.run(100);
+    TEST_ASSERT_EQUAL(1, (int)commands.size());
+    lan.gateway(3).broadcastDelta(1, 0, 2, "ac_mode: heat", 0, commands[0].from, commands[0].seq);
+    lan.run(100);
+
+    TEST_ASSERT_EQUAL(2, (int)deltas.size());  // Gateways 1 and 2, not the sender
+    for (const Received& delta : deltas) {
+        TEST_ASSERT_NOT_EQUAL(3, delta.gateway);
+        TEST_ASSERT_EQUAL_UINT8(3, delta.from);
+        TEST_ASSERT_EQUAL_STRING("ac_mode: heat", delta.text);
+    }
+    TEST_ASSERT_EQUAL_UINT32(1, lan.gateway(1).forwardLatency.count());
+    TEST_ASSERT_EQUAL_UINT32(0, lan.gateway(2).forwardLatency.count());
+}
+
+/**
+ * @brief Gateway 3 owns device 0; gateway 1 forwards its commands.
+ */
+static void ownDeviceByGateway3(Lan& lan) {
+    lan.gateway(1).observeLocal(0, -80, false);
+    lan.gateway(3).observeLocal(0, -60, true);
+    lan.run(3000);
+    lan.assertOwner(0, 3);
+}
+
+void test_lost_command_is_resent() {
+    Lan lan;
+    ownDeviceByGateway3(lan);
+    lan.network.lose[FED_COMMAND] = 1;
+    TEST_ASSERT_TRUE(lan.gateway(1).forwardCommand(7, 0, "heat"));
+    lan.run(100);
+    TEST_ASSERT_EQUAL(0, (int)commands.size());
+    lan.run(FEDERATION_ACK_TIMEOUT_MS);
+    TEST_ASSERT_EQUAL(1, (int)commands.size());
+    TEST_ASSERT_EQUAL_STRING("heat", commands[0].text);
+    lan.run(1000);
+    TEST_ASSERT_EQUAL_UINT32(1, lan.gateway(1).retryCount());
+    TEST_ASSERT_EQUAL_UINT32(0, lan.gateway(1).failedCount());
+    TEST_ASSERT_EQUAL(0, (int)failedForwards.size());
+}
+
+void test_resent_command_executes_once() {
+    Lan lan;
+    ownDeviceByGateway3(lan);
+    lan.network.lose[FED_ACK] = 1;  // The owner queued the command, but the sender does not know
+    TEST_ASSERT_TRUE(lan.gateway(1).forwardCommand(0, 0, ""));  // A toggle must not run twice
+    lan.run(1000);
+    TEST_ASSERT_EQUAL_UINT32(1, lan.gateway(1).retryCount());
+    TEST_ASSERT_EQUAL(1, (int)commands.size());
+    TEST_ASSERT_EQUAL_UINT32(1, lan.gateway(3).receivedCount());
+    TEST_ASSERT_EQUAL(0, (int)failedForwards.size());
+
+    // A lost ack is also made up for by the delta answering the command
+    lan.network.lose[FED_ACK] = 1;
+    TEST_ASSERT_TRUE(lan.gateway(1).forwardCommand(1, 0, "p_high"));
+    lan.run(50);
+    lan.gateway(3).broadcastDelta(1, 0, 1, "power_ac: p_high", 0, commands[1].from, commands[1].seq);
+    lan.run(1000);
+    TEST_ASSERT_EQUAL_UINT32(1, lan.gateway(1).retryCount());
+    TEST_ASSERT_EQUAL(2, (int)commands.size());
+}
+
+void test_unacknowledged_command_is_handed_back() {
+    Lan lan;
+    ownDeviceByGateway3(lan);
+    lan.network.lose[FED_COMMAND] = FEDERATION_FORWARD_ATTEMPTS;
+    TEST_ASSERT_TRUE(lan.gateway(1).forwardCommand(7, 0, "heat"));
+    lan.run(FEDERATION_ACK_TIMEOUT_MS * FEDERATION_FORWARD_ATTEMPTS + 100);
+    TEST_ASSERT_EQUAL(0, (int)commands.size());
+    TEST_ASSERT_EQUAL_UINT32(FEDERATION_FORWARD_ATTEMPTS - 1, lan.gateway(1).retryCount());
+    TEST_ASSERT_EQUAL_UINT32(1, lan.gateway(1).failedCount());
+    TEST_ASSERT_EQUAL(1, (int)failedForwards.size());
+    TEST_ASSERT_EQUAL_UINT8(7, failedForwards[0].kind);
+    TEST_ASSERT_EQUAL(0, failedForwards[0].device);
+    TEST_ASSERT_EQUAL_STRING("heat", failedForwards[0].text);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_best_rssi_owns_the_device);
+    RUN_TEST(test_connected_device_moves_only_past_the_margin);
+    RUN_TEST(test_silent_holder_loses_the_device);
+    RUN_TEST(test_command_is_forwarded_to_the_owner);
+    RUN_TEST(test_delta_reaches_every_peer);
+    RUN_TEST(test_lost_command_is_resent);
+    RUN_TEST(test_resent_command_executes_once);
+    RUN_TEST(test_unacknowledged_command_is_handed_back);
+    return UNITY_END();
+}
@@ -0,0 +1,138 @@
+// Host replay of traffic recordings: pio test -e native -f test_replay
+//
+// A recording from the gateway ("trace_dump" on the serial console) can be
+// replayed too: TRACE_FILE=trace.txt pio test -e native -f test_replay
+
+#include <unity.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "trace_replay.h"
+
+// As printed by trace_dump: the snapshot (AC and damper1 connected, damper3 away),
+// then the frames with their statuses, which arrive out of order and among
+// statuses not caused by a frame.
+static const char* const RECORDING =
+    "# trace 16 events\n"
+    "120 connect 0 0 \n"
+    "125 state 0 0 state off\n"
+    "130 connect 1 0 \n"
+    "131 state 1 0 state on\n"
+    "133 state 1 0 power p_low\n"
+    "140 state 3 0 state on\n"
+    "5000 ws -1 7 toggle_damper1\n"
+    "5100 ws -1 8 power_damper1:p_high\n"
+    "5300 status 1 8 power_damper1:p_high\n"
+    "5350 status 1 7 status_damper1:off\n"
+    "6000 notify 1 0 3.71\n"
+    "6100 status 2 0 status_damper2:on\n"
+    "7000 ws -1 13 toggle_damper3\n"
+    "7100 status 3 13 status_damper3:off\n"
+    "8000 ws -1 15 set_ac_temp:24\n"
+    "8100 status 0 15 ac_temp: 24\n";
+
+static TraceEvent events[TraceReplayer::MAX_EVENTS];
+static TraceReplayer replayer;
+
+/**
+ * @brief Parses a dump, skipping the lines for which skip returns true.
+ */
+static size_t parseRecording(const char* text, bool (*skip)(const TraceEvent&) = nullptr) {
+    size_t count = 0;
+    while (*text && count < TraceReplayer::MAX_EVENTS) {
+        if (parseTraceLine(text, events[count]) && !(skip && skip(events[count]))) count++;
+        const char* end = strchr(text, '\n');
+        text = end ? end + 1 : text + strlen(text);
+    }
+    return count;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_dump_lines_parse_back() {
+    TraceEvent event;
+    TEST_ASSERT_TRUE(parseTraceLine("8100 status 0 15 ac_temp: 24\n", event));
+    TEST_ASSERT_EQUAL(TRACE_STATUS, event.type);
+    TEST_ASSERT_EQUAL(0, event.device);
+    TEST_ASSERT_EQUAL(15, event.seq);
+    TEST_ASSERT_EQUAL_UINT32(8100, event.timestampUs);
+    TEST_ASSERT_EQUAL_STRING("ac_temp: 24", event.data);
+
+    TEST_ASSERT_TRUE(parseTraceLine("120 connect 0 0 ", event));
+    TEST_ASSERT_EQUAL(TRACE_BLE_CONNECT, event.type);
+    TEST_ASSERT_EQUAL(0, event.length);
+
+    TEST_ASSERT_FALSE(parseTraceLine("# trace 16 events", event));
+    TEST_ASSERT_FALSE(parseTraceLine("120 bogus 0 0 x", event));
+    TEST_ASSERT_FALSE(parseTraceLine("120 ws -1", event));  // Dump without sequence numbers
+}
+
+void test_recording_replays_identically() {
+    const ReplayReport report = replayer.replay(events, parseRecording(RECORDING));
+    TEST_ASSERT_EQUAL(4, (int)report.frames);
+    TEST_ASSERT_EQUAL(4, (int)report.commands);
+    TEST_ASSERT_EQUAL(4, (int)report.statesRestored);
+    TEST_ASSERT_EQUAL(4, (int)report.expected);
+    TEST_ASSERT_EQUAL(4, (int)report.matched);
+    TEST_ASSERT_TRUE(report.identical());
+    // damper3 was away: its command waits for reconciliation, as on the gateway
+    TEST_ASSERT_EQUAL(1 << CONTROL_STATE, (int)pendingFields[3]);
+    TEST_ASSERT_EQUAL(0, (int)pendingFields[1]);
+}
+
+static bool isSnapshot(const TraceEvent& event) { return event.type == TRACE_STATE; }
+
+void test_missing_snapshot_diverges() {
+    // Without the recorded states the toggles start from "off" and turn the dampers on
+    const ReplayReport report = replayer.replay(events, parseRecording(RECORDING, isSnapshot));
+    TEST_ASSERT_EQUAL(2, (int)report.matched);
+    TEST_ASSERT_EQUAL(2, (int)report.divergent);
+    TEST_ASSERT_FALSE(report.identical());
+}
+
+static bool isAcTempStatus(const TraceEvent& event) { return event.type == TRACE_STATUS && event.seq == 15; }
+
+void test_unrecorded_status_is_reported() {
+    // e.g. the command was forwarded to the gateway that owned the AC
+    const ReplayReport report = replayer.replay(events, parseRecording(RECORDING, isAcTempStatus));
+    TEST_ASSERT_EQUAL(3, (int)report.matched);
+    TEST_ASSERT_EQUAL(1, (int)report.unexpected);
+    TEST_ASSERT_EQUAL(0, (int)report.missing);
+}
+
+void test_replay_does_not_write_the_real_store() {
+    RamStateStore deviceStore;
+    stateStore = &deviceStore;
+    replayer.replay(events, parseRecording(RECORDING));
+    char value[48];
+    TEST_ASSERT_FALSE(deviceStore.read("damper1_state", value, sizeof(value)));
+    TEST_ASSERT_TRUE(loadState("damper1_state", value, sizeof(value)));  // The replayer's own store
+}
+
+void test_trace_file() {
+    const char* path = getenv("TRACE_FILE");
+    if (!path) TEST_IGNORE_MESSAGE("TRACE_FILE not set");
+    FILE* file = fopen(path, "r");
+    TEST_ASSERT_TRUE(file != nullptr);
+    size_t count = 0;
+    char line[128];
+    while (count < TraceReplayer::MAX_EVENTS && fgets(line, sizeof(line), file))
+        if (parseTraceLine(line, events[count])) count++;
+    fclose(file);
+    const ReplayReport report = replayer.replay(events, count);
+    report.print(stdout);
+    TEST_ASSERT_EQUAL(0, (int)report.divergent);
+    TEST_ASSERT_EQUAL(0, (int)report.missing);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_dump_lines_parse_back);
+    RUN_TEST(test_recording_replays_identically);
+    RUN_TEST(test_missing_snapshot_diverges);
+    RUN_TEST(test_unrecorded_status_is_reported);
+    RUN_TEST(test_replay_does_not_write_the_real_store);
+    RUN_TEST(test_trace_file);
+    return UNITY_END();
+}
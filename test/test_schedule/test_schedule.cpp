@@ -0,0 +1,105 @@
+// Host tests of the schedule entries: pio test -e native -f test_schedule
+
+#include <unity.h>
+#include "schedule.h"
+
+void setUp() {}
+void tearDown() {}
+
+void test_valid_entries_parse() {
+    ScheduleEntry entry = {};
+    TEST_ASSERT_TRUE(parseSchedule("23:00 damper2 state off", entry));
+    TEST_ASSERT_EQUAL(1, entry.used);
+    TEST_ASSERT_EQUAL(23, entry.hour);
+    TEST_ASSERT_EQUAL(0, entry.minute);
+    TEST_ASSERT_EQUAL(CMD_SET_STATE, entry.kind);
+    TEST_ASSERT_EQUAL(2, entry.device);
+    TEST_ASSERT_EQUAL_STRING("off", entry.value);
+
+    TEST_ASSERT_TRUE(parseSchedule("07:30 ac temp 24", entry));
+    TEST_ASSERT_EQUAL(CMD_TEMP, entry.kind);
+    TEST_ASSERT_EQUAL(0, entry.device);
+    TEST_ASSERT_EQUAL_STRING("24", entry.value);
+
+    TEST_ASSERT_TRUE(parseSchedule("0:05 ac mode heat", entry));
+    TEST_ASSERT_EQUAL(5, entry.minute);
+    TEST_ASSERT_EQUAL(CMD_MODE, entry.kind);
+
+    TEST_ASSERT_TRUE(parseSchedule("12:59 damper3 power p_high\n", entry));  // Trailing whitespace is fine
+    TEST_ASSERT_EQUAL(CMD_POWER, entry.kind);
+    TEST_ASSERT_EQUAL_STRING("p_high", entry.value);
+
+    TEST_ASSERT_TRUE(parseSchedule("06:00 ac mode abcdefghijk", entry));  // The longest value that fits
+    TEST_ASSERT_EQUAL_STRING("abcdefghijk", entry.value);
+}
+
+void test_out_of_range_entries_are_rejected() {
+    static const char* const invalid[] = {
+        "24:00 ac state on",
+        "23:60 ac state on",
+        "99:99 ac state on",
+        "-1:00 ac state on",
+        "12:00 damper0 state on",
+        "12:00 damper4 state on",
+        "12:00 damper12 state on",
+        "12:00 damper2 mode heat",  // AC-only fields
+        "12:00 damper1 temp 22",
+        "12:00 ac state maybe",
+    };
+    for (const char* text : invalid) {
+        ScheduleEntry entry = {};
+        TEST_ASSERT_FALSE_MESSAGE(parseSchedule(text, entry), text);
+        TEST_ASSERT_EQUAL(0, entry.used);
+    }
+}
+
+void test_malformed_entries_are_rejected() {
+    static const char* const invalid[] = {
+        "",
+        "12:00",
+        "12:00 ac state",
+        "1200 ac state on",
+        "12-00 ac state on",
+        "123:00 ac state on",
+        "ab:cd ac state on",
+        "12:00 fan state on",
+        "12:00 ac speed p_high",
+        "12:00 ac state on extra",
+        "12:00 ac mode abcdefghijkl",  // Too long to store
+        "12:00 livingroom_damper state on",
+    };
+    for (const char* text : invalid) {
+        ScheduleEntry entry = {};
+        TEST_ASSERT_FALSE_MESSAGE(parseSchedule(text, entry), text);
+        TEST_ASSERT_EQUAL(0, entry.used);
+    }
+}
+
+void test_rejected_entry_is_left_unchanged() {
+    ScheduleEntry entry = {};
+    TEST_ASSERT_TRUE(parseSchedule("08:15 damper1 state on", entry));
+    TEST_ASSERT_FALSE(parseSchedule("08:15 ac mode heat extra", entry));
+    TEST_ASSERT_EQUAL(1, entry.device);
+    TEST_ASSERT_EQUAL(CMD_SET_STATE, entry.kind);
+}
+
+void test_formatted_entry_parses_back() {
+    ScheduleEntry entry = {};
+    TEST_ASSERT_TRUE(parseSchedule("7:05 damper3 power p_low", entry));
+    FixedString<48> text;
+    formatSchedule(4, entry, text);
+    TEST_ASSERT_EQUAL_STRING("schedule:4 07:05 damper3 power p_low", text.c_str());
+    ScheduleEntry again = {};
+    TEST_ASSERT_TRUE(parseSchedule(text.c_str() + 11, again));
+    TEST_ASSERT_EQUAL(0, memcmp(&entry, &again, sizeof(entry)));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_valid_entries_parse);
+    RUN_TEST(test_out_of_range_entries_are_rejected);
+    RUN_TEST(test_malformed_entries_are_rejected);
+    RUN_TEST(test_rejected_entry_is_left_unchanged);
+    RUN_TEST(test_formatted_entry_parses_back);
+    return UNITY_END();
+}
@@ -0,0 +1,162 @@
+// Host tests of the timer wheel: pio test -e native -f test_timer_wheel
+//
+// The wheel is advanced one tick at a time and every callback records the
+// time it ran at, so late, early and missed timers all show up.
+
+#include <unity.h>
+#include <vector>
+#include "timer_wheel.h"
+
+static uint32_t nowMs = 0;
+static std::vector<uint32_t> runs;  ///< nowMs of every callback, in order
+
+static void recordRun(void*) { runs.push_back(nowMs); }
+static void recordRunInto(void* arg) { static_cast<std::vector<uint32_t>*>(arg)->push_back(nowMs); }
+
+/**
+ * @brief Advance the wheel tick by tick until the given time.
+ */
+template <size_t N>
+static void advanceTo(TimerWheel<N>& wheel, uint32_t untilMs) {
+    while (nowMs < untilMs) {
+        nowMs += TIMER_TICK_MS;
+        wheel.advance(nowMs);
+    }
+}
+
+void setUp() {
+    nowMs = 0;
+    runs.clear();
+}
+
+void tearDown() {}
+
+void test_one_shot_runs_once_on_its_tick() {
+    TimerWheel<4> wheel;
+    wheel.begin(nowMs);
+    const TimerId id = wheel.schedule(25, recordRun);  // Rounded up to 3 ticks
+    TEST_ASSERT_NOT_EQUAL(0, id);
+    TEST_ASSERT_TRUE(wheel.isScheduled(id));
+    advanceTo(wheel, 100);
+    TEST_ASSERT_EQUAL(1, (int)runs.size());
+    TEST_ASSERT_EQUAL_UINT32(30, runs[0]);
+    TEST_ASSERT_FALSE(wheel.isScheduled(id));
+    TEST_ASSERT_EQUAL(0, (int)wheel.size());
+
+    wheel.schedule(0, recordRun);  // At least one tick
+    advanceTo(wheel, 110);
+    TEST_ASSERT_EQUAL(2, (int)runs.size());
+    TEST_ASSERT_EQUAL_UINT32(110, runs[1]);
+}
+
+void test_timers_cascade_on_their_exact_tick() {
+    // Delays on each side of the level boundaries (64, 4096 and 262144 ticks),
+    // from a start that is not aligned to any of them
+    static const uint32_t delayTicks[] = {63, 64, 65, 127, 128, 4095, 4096, 4097, 262143, 262144, 262145};
+    const size_t count = sizeof(delayTicks) / sizeof(delayTicks[0]);
+    nowMs = 37 * TIMER_TICK_MS;
+    TimerWheel<16> wheel;
+    wheel.begin(nowMs);
+    const uint32_t startMs = nowMs;
+    for (size_t i = 0; i < count; ++i) wheel.schedule(delayTicks[i] * TIMER_TICK_MS, recordRun);
+    advanceTo(wheel, startMs + 262150 * TIMER_TICK_MS);
+    TEST_ASSERT_EQUAL((int)count, (int)runs.size());
+    for (size_t i = 0; i < count; ++i) TEST_ASSERT_EQUAL_UINT32(startMs + delayTicks[i] * TIMER_TICK_MS, runs[i]);
+}
+
+void test_advance_catches_up_in_one_call() {
+    TimerWheel<4> wheel;
+    wheel.begin(nowMs);
+    wheel.schedule(5000 * TIMER_TICK_MS, recordRun);
+    wheel.schedule(70 * TIMER_TICK_MS, recordRun);
+    TEST_ASSERT_EQUAL(2, (int)wheel.advance(6000 * TIMER_TICK_MS));
+    TEST_ASSERT_EQUAL(0, (int)wheel.size());
+}
+
+void test_periodic_timer_rearms_on_its_cadence() {
+    TimerWheel<4> wheel;
+    wheel.begin(nowMs);
+    const TimerId id = wheel.schedule(100, recordRun, nullptr, 30);
+    advanceTo(wheel, 200);
+    TEST_ASSERT_EQUAL(4, (int)runs.size());  // 100, 130, 160, 190
+    TEST_ASSERT_EQUAL_UINT32(100, runs[0]);
+    TEST_ASSERT_EQUAL_UINT32(190, runs[3]);
+    TEST_ASSERT_TRUE(wheel.isScheduled(id));
+    TEST_ASSERT_EQUAL(1, (int)wheel.size());
+
+    // A periodic timer whose period crosses a level boundary keeps its cadence
+    std::vector<uint32_t> slowRuns;
+    const TimerId slow = wheel.schedule(650, recordRunInto, &slowRuns, 650);
+    advanceTo(wheel, 200 + 3 * 650);
+    TEST_ASSERT_EQUAL(3, (int)slowRuns.size());
+    for (size_t i = 0; i < slowRuns.size(); ++i) TEST_ASSERT_EQUAL_UINT32(200 + (i + 1) * 650, slowRuns[i]);
+    TEST_ASSERT_TRUE(wheel.cancel(slow));
+    TEST_ASSERT_TRUE(wheel.cancel(id));
+    TEST_ASSERT_EQUAL(0, (int)wheel.size());
+}
+
+void test_cancel_before_it_runs() {
+    TimerWheel<4> wheel;
+    wheel.begin(nowMs);
+    const TimerId near = wheel.schedule(50, recordRun);
+    const TimerId far = wheel.schedule(64 * 64 * TIMER_TICK_MS, recordRun);  // On level 2
+    const TimerId kept = wheel.schedule(60, recordRun);
+    TEST_ASSERT_TRUE(wheel.cancel(near));
+    TEST_ASSERT_TRUE(wheel.cancel(far));
+    TEST_ASSERT_FALSE(wheel.cancel(near));  // Already cancelled
+    TEST_ASSERT_FALSE(wheel.cancel(0));
+    TEST_ASSERT_EQUAL(1, (int)wheel.size());
+    advanceTo(wheel, 64 * 64 * TIMER_TICK_MS + 100);
+    TEST_ASSERT_EQUAL(1, (int)runs.size());
+    TEST_ASSERT_EQUAL_UINT32(60, runs[0]);
+    TEST_ASSERT_FALSE(wheel.cancel(kept));  // Already ran
+
+    // The node is reused under a new generation: the stale id does not cancel the new timer
+    const TimerId reused = wheel.schedule(10, recordRun);
+    TEST_ASSERT_FALSE(wheel.cancel(near));
+    TEST_ASSERT_TRUE(wheel.isScheduled(reused));
+}
+
+static TimerWheel<4>* selfCancelWheel = nullptr;
+static TimerId selfCancelId = 0;
+
+static void cancelItself(void*) {
+    runs.push_back(nowMs);
+    if (runs.size() == 3) selfCancelWheel->cancel(selfCancelId);
+}
+
+void test_periodic_timer_cancels_itself() {
+    TimerWheel<4> wheel;
+    wheel.begin(nowMs);
+    selfCancelWheel = &wheel;
+    selfCancelId = wheel.schedule(20, cancelItself, nullptr, 20);
+    advanceTo(wheel, 500);
+    TEST_ASSERT_EQUAL(3, (int)runs.size());
+    TEST_ASSERT_FALSE(wheel.isScheduled(selfCancelId));
+    TEST_ASSERT_EQUAL(0, (int)wheel.size());
+}
+
+void test_full_pool_refuses_timers() {
+    TimerWheel<2> wheel;
+    wheel.begin(nowMs);
+    TEST_ASSERT_NOT_EQUAL(0, wheel.schedule(10, recordRun));
+    TEST_ASSERT_NOT_EQUAL(0, wheel.schedule(10, recordRun));
+    TEST_ASSERT_EQUAL(0, wheel.schedule(10, recordRun));
+    TEST_ASSERT_EQUAL_UINT32(1, wheel.poolFailures());
+    TEST_ASSERT_EQUAL(2, (int)wheel.peak());
+    advanceTo(wheel, 10);
+    TEST_ASSERT_EQUAL(2, (int)runs.size());
+    TEST_ASSERT_NOT_EQUAL(0, wheel.schedule(10, recordRun));  // Nodes back in the pool
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_one_shot_runs_once_on_its_tick);
+    RUN_TEST(test_timers_cascade_on_their_exact_tick);
+    RUN_TEST(test_advance_catches_up_in_one_call);
+    RUN_TEST(test_periodic_timer_rearms_on_its_cadence);
+    RUN_TEST(test_cancel_before_it_runs);
+    RUN_TEST(test_periodic_timer_cancels_itself);
+    RUN_TEST(test_full_pool_refuses_timers);
+    return UNITY_END();
+}